@@ -0,0 +1,80 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "bitmask.hh"
+
+// Bits [begin, end) of a 64-bit word
+static uint64_t word_bits(unsigned begin, unsigned end)
+{
+    uint64_t high = end >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << end) - 1;
+    return high & ~(((uint64_t)1 << begin) - 1);
+}
+
+bitmask::bitmask(glm::uvec3 dim)
+:   dim(dim),
+    row_words((dim.x + 63) / 64),
+    data(checked_product(row_words, dim.y, dim.z), sizeof(uint64_t)),
+    words(data.get<uint64_t>())
+{
+}
+
+void bitmask::set_run(
+    unsigned y, unsigned z, unsigned x_begin, unsigned x_end
+){
+    if(x_begin >= x_end) return;
+
+    uint64_t* row = get_row(y, z);
+    unsigned first_word = x_begin / 64;
+    unsigned last_word = (x_end - 1) / 64;
+    for(unsigned i = first_word; i <= last_word; ++i)
+    {
+        unsigned b = i == first_word ? x_begin % 64 : 0;
+        unsigned e = i == last_word ? (x_end - 1) % 64 + 1 : 64;
+        row[i] |= word_bits(b, e);
+    }
+}
+
+bool bitmask::row_empty(unsigned y, unsigned z) const
+{
+    const uint64_t* row = get_row(y, z);
+    for(unsigned i = 0; i < row_words; ++i)
+        if(row[i]) return false;
+    return true;
+}
+
+bool bitmask::box_empty(glm::uvec3 begin, glm::uvec3 end) const
+{
+    if(begin.x >= end.x) return true;
+
+    unsigned first_word = begin.x / 64;
+    unsigned last_word = (end.x - 1) / 64;
+    for(unsigned z = begin.z; z < end.z; ++z)
+    {
+        for(unsigned y = begin.y; y < end.y; ++y)
+        {
+            const uint64_t* row = get_row(y, z);
+            for(unsigned i = first_word; i <= last_word; ++i)
+            {
+                unsigned b = i == first_word ? begin.x % 64 : 0;
+                unsigned e = i == last_word ? (end.x - 1) % 64 + 1 : 64;
+                if(row[i] & word_bits(b, e)) return false;
+            }
+        }
+    }
+    return true;
+}
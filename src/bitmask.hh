@@ -0,0 +1,119 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_BITMASK_HH
+#define VOXELSLICER_BITMASK_HH
+#include <glm/glm.hpp>
+#include <cstdint>
+#include "storage.hh"
+
+/* One bit per voxel. Each row along the x-axis is packed into 64-bit words,
+ * starting from a new word, so that whole rows can be scanned 64 voxels at a
+ * time. The padding bits at the end of each row are always zero.
+ */
+class bitmask
+{
+public:
+    explicit bitmask(glm::uvec3 dim);
+    bitmask(const bitmask& other) = delete;
+
+    glm::uvec3 get_dim() const { return dim; }
+    unsigned get_row_words() const { return row_words; }
+
+    uint64_t* get_row(unsigned y, unsigned z) const
+    {
+        return words + ((size_t)z * dim.y + y) * row_words;
+    }
+
+    bool get(glm::uvec3 pos) const
+    {
+        return (get_row(pos.y, pos.z)[pos.x/64] >> (pos.x%64)) & 1;
+    }
+
+    void set(glm::uvec3 pos)
+    {
+        get_row(pos.y, pos.z)[pos.x/64] |= (uint64_t)1 << (pos.x%64);
+    }
+
+    // Like set(), but safe to call from several threads at once.
+    void set_atomic(glm::uvec3 pos)
+    {
+        uint64_t* word = get_row(pos.y, pos.z) + pos.x/64;
+        uint64_t bit = (uint64_t)1 << (pos.x%64);
+        if(!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    }
+
+    // Sets bits [x_begin, x_end) of a row.
+    void set_run(unsigned y, unsigned z, unsigned x_begin, unsigned x_end);
+
+    bool row_empty(unsigned y, unsigned z) const;
+
+    /* Calls f(x_begin, x_end) for each run of set bits [x_begin, x_end) in a
+     * row, in order. Runs are found a word at a time, so long runs of either
+     * value cost little.
+     */
+    template<typename F>
+    void for_each_run(unsigned y, unsigned z, F&& f) const
+    {
+        for_each_word_run(get_row(y, z), row_words, f);
+    }
+
+    // Same for any row of words whose padding bits are zero.
+    template<typename F>
+    static void for_each_word_run(
+        const uint64_t* words, unsigned word_count, F&& f
+    ){
+        unsigned w = 0;
+        uint64_t bits = word_count ? words[0] : 0;
+        for(;;)
+        {
+            while(!bits)
+            {
+                if(++w >= word_count) return;
+                bits = words[w];
+            }
+            unsigned begin = w * 64 + __builtin_ctzll(bits);
+
+            uint64_t clear = ~words[w] & (~(uint64_t)0 << (begin % 64));
+            while(!clear)
+            {
+                if(++w >= word_count)
+                {
+                    f(begin, w * 64);
+                    return;
+                }
+                clear = ~words[w];
+            }
+            unsigned end = w * 64 + __builtin_ctzll(clear);
+            f(begin, end);
+            bits = words[w] & (~(uint64_t)0 << (end % 64));
+        }
+    }
+
+    // True if no bit in the box [begin, end) is set.
+    bool box_empty(glm::uvec3 begin, glm::uvec3 end) const;
+
+private:
+    glm::uvec3 dim;
+    unsigned row_words;
+    storage data;
+    uint64_t* words;
+};
+
+#endif
@@ -0,0 +1,266 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "brick.hh"
+#include <algorithm>
+#include <cstring>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define PALETTE_MAX 256
+#define PALETTE_HASH_SIZE 512
+
+static bool is_zero(const uint8_t* data, size_t size)
+{
+    for(size_t i = 0; i < size; ++i)
+        if(data[i]) return false;
+    return true;
+}
+
+static void write_length(std::vector<uint8_t>& out, size_t len)
+{
+    for(; len >= 255; len -= 255) out.push_back(255);
+    out.push_back(len);
+}
+
+static size_t read_length(const uint8_t*& in)
+{
+    size_t len = 0;
+    uint8_t b;
+    do len += (b = *in++);
+    while(b == 255);
+    return len;
+}
+
+/* Sequences follow the LZ4 block format: a token with the literal length in
+ * the high nibble and the match length in the low nibble, extra length bytes,
+ * the literals, and finally a 16-bit little-endian match offset. The last
+ * sequence only has literals.
+ */
+static void lz_write_sequence(
+    std::vector<uint8_t>& out,
+    const uint8_t* literals,
+    size_t literal_len,
+    size_t offset,
+    size_t match_len
+){
+    size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    out.push_back(
+        (std::min<size_t>(literal_len, 15) << 4) |
+        std::min<size_t>(match_code, 15)
+    );
+    if(literal_len >= 15) write_length(out, literal_len - 15);
+    out.insert(out.end(), literals, literals + literal_len);
+    if(!match_len) return;
+
+    out.push_back(offset & 0xFF);
+    out.push_back(offset >> 8);
+    if(match_code >= 15) write_length(out, match_code - 15);
+}
+
+static void lz_compress(
+    const uint8_t* src,
+    size_t size,
+    std::vector<uint8_t>& out
+){
+    uint32_t table[1<<LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while(i + LZ_MIN_MATCH <= size)
+    {
+        uint32_t seq;
+        memcpy(&seq, src + i, sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = i;
+
+        if(
+            candidate != UINT32_MAX &&
+            i - candidate <= LZ_MAX_OFFSET &&
+            memcmp(src + candidate, src + i, LZ_MIN_MATCH) == 0
+        ){
+            size_t len = LZ_MIN_MATCH;
+            while(i + len < size && src[candidate + len] == src[i + len])
+                ++len;
+            lz_write_sequence(
+                out, src + anchor, i - anchor, i - candidate, len
+            );
+            i += len;
+            anchor = i;
+        }
+        // Skip faster over data that doesn't seem to compress
+        else i += 1 + ((i - anchor) >> 6);
+    }
+    lz_write_sequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+static void lz_decompress(const uint8_t* in, uint8_t* dst, size_t size)
+{
+    size_t o = 0;
+    for(;;)
+    {
+        uint8_t token = *in++;
+        size_t literal_len = token >> 4;
+        if(literal_len == 15) literal_len += read_length(in);
+        memcpy(dst + o, in, literal_len);
+        in += literal_len;
+        o += literal_len;
+        if(o >= size) break;
+
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match_len = token & 0xF;
+        if(match_len == 15) match_len += read_length(in);
+        match_len += LZ_MIN_MATCH;
+
+        // Matches may overlap themselves, so this must go byte by byte.
+        for(size_t end = o + match_len; o < end; ++o)
+            dst[o] = dst[o - offset];
+    }
+}
+
+static uint32_t hash_bytes(const uint8_t* data, size_t size)
+{
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < size; ++i) h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+// Returns false if there are more than PALETTE_MAX distinct elements.
+static bool build_palette(
+    const uint8_t* data,
+    size_t element_size,
+    std::vector<uint8_t>& palette,
+    uint8_t* indices
+){
+    int16_t slots[PALETTE_HASH_SIZE];
+    memset(slots, 0xFF, sizeof(slots));
+    unsigned count = 0;
+
+    for(size_t i = 0; i < BRICK_VOXELS; ++i)
+    {
+        const uint8_t* e = data + i * element_size;
+        uint32_t h = hash_bytes(e, element_size) % PALETTE_HASH_SIZE;
+        while(
+            slots[h] >= 0 &&
+            memcmp(&palette[slots[h] * element_size], e, element_size)
+        ) h = (h + 1) % PALETTE_HASH_SIZE;
+
+        if(slots[h] < 0)
+        {
+            if(count == PALETTE_MAX) return false;
+            slots[h] = count++;
+            palette.insert(palette.end(), e, e + element_size);
+        }
+        indices[i] = slots[h];
+    }
+    return true;
+}
+
+bool encode_brick(
+    const void* elements,
+    size_t element_size,
+    std::vector<uint8_t>& encoded
+){
+    const uint8_t* data = static_cast<const uint8_t*>(elements);
+    size_t size = BRICK_VOXELS * element_size;
+    encoded.clear();
+
+    if(is_zero(data, size)) return true;
+
+    std::vector<uint8_t> palette;
+    uint8_t indices[BRICK_VOXELS];
+    if(build_palette(data, element_size, palette, indices))
+    {
+        unsigned count = palette.size() / element_size;
+        if(count == 1)
+        {
+            encoded.push_back(BRICK_UNIFORM);
+            encoded.insert(encoded.end(), palette.begin(), palette.end());
+            return true;
+        }
+
+        encoded.push_back(BRICK_PALETTE);
+        encoded.push_back(count - 1);
+        encoded.insert(encoded.end(), palette.begin(), palette.end());
+        // Small palettes pack two indices per byte
+        if(count <= 16)
+        {
+            for(size_t i = 0; i < BRICK_VOXELS; i += 2)
+                encoded.push_back(indices[i] | (indices[i+1] << 4));
+        }
+        else encoded.insert(encoded.end(), indices, indices + BRICK_VOXELS);
+
+        if(encoded.size() < size) return true;
+        encoded.clear();
+    }
+
+    encoded.push_back(BRICK_LZ);
+    lz_compress(data, size, encoded);
+    if(encoded.size() < size) return true;
+
+    encoded.clear();
+    return false;
+}
+
+void decode_brick(
+    const std::vector<uint8_t>& encoded,
+    size_t element_size,
+    void* elements
+){
+    uint8_t* data = static_cast<uint8_t*>(elements);
+    size_t size = BRICK_VOXELS * element_size;
+
+    if(encoded.empty())
+    {
+        memset(data, 0, size);
+        return;
+    }
+
+    const uint8_t* in = encoded.data() + 1;
+    switch(encoded[0])
+    {
+    case BRICK_UNIFORM:
+        for(size_t i = 0; i < BRICK_VOXELS; ++i)
+            memcpy(data + i * element_size, in, element_size);
+        break;
+    case BRICK_PALETTE:
+        {
+            unsigned count = *in++ + 1;
+            const uint8_t* palette = in;
+            const uint8_t* indices = in + count * element_size;
+            for(size_t i = 0; i < BRICK_VOXELS; ++i)
+            {
+                unsigned index = count <= 16 ?
+                    (indices[i/2] >> ((i&1) * 4)) & 0xF : indices[i];
+                memcpy(
+                    data + i * element_size,
+                    palette + index * element_size,
+                    element_size
+                );
+            }
+        }
+        break;
+    case BRICK_LZ:
+        lz_decompress(in, data, size);
+        break;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_BRICK_HH
+#define VOXELSLICER_BRICK_HH
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bricks are cubes of BRICK_SIZE^3 voxels, stored contiguously.
+#define BRICK_SIZE_LOG2 4
+#define BRICK_SIZE (1u<<BRICK_SIZE_LOG2)
+#define BRICK_VOXELS (BRICK_SIZE*BRICK_SIZE*BRICK_SIZE)
+
+enum brick_encoding
+{
+    BRICK_EMPTY = 0,
+    BRICK_UNIFORM,
+    BRICK_PALETTE,
+    BRICK_LZ
+};
+
+/* Compresses a brick of BRICK_VOXELS elements of element_size bytes each.
+ * The smallest applicable encoding is picked: an all-zero brick encodes to
+ * nothing, a brick of one repeated element stores only that element, bricks
+ * with at most 256 distinct elements store a palette and indices, and
+ * everything else is compressed with an LZ4-style byte compressor. Returns
+ * false if the brick doesn't compress at all, in which case it should be
+ * kept uncompressed.
+ */
+bool encode_brick(
+    const void* elements,
+    size_t element_size,
+    std::vector<uint8_t>& encoded
+);
+
+// Decodes a brick encoded by encode_brick() into BRICK_VOXELS elements.
+void decode_brick(
+    const std::vector<uint8_t>& encoded,
+    size_t element_size,
+    void* elements
+);
+
+#endif
@@ -0,0 +1,525 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "components.hh"
+#include "storage.hh"
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <numeric>
+
+typedef std::pair<size_t, size_t> edge;
+
+static void compact_edges(std::vector<edge>& edges)
+{
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+}
+
+// The runs of a single row
+struct components::run_row
+{
+    const uint32_t* start;
+    const size_t* label;
+    size_t count;
+    bool first_occupied;
+    unsigned width;
+
+    unsigned get_end(size_t run) const
+    {
+        return run + 1 < count ? start[run + 1] : width;
+    }
+
+    // Runs alternate between empty and occupied
+    bool is_occupied(size_t run) const
+    {
+        return first_occupied != (run & 1);
+    }
+};
+
+/* The runs of the layers [z_begin, z_end), labeled by component with
+ * consecutive labels starting from first_label.
+ */
+class components::slab
+{
+public:
+    slab(
+        const bitmask& occupancy,
+        thread_pool& pool,
+        unsigned z_begin,
+        unsigned z_end,
+        size_t first_label
+    );
+    slab(const slab& other) = delete;
+
+    unsigned get_z_begin() const { return z_begin; }
+    unsigned get_z_end() const { return z_end; }
+    size_t get_label_count() const { return label_occupied.size(); }
+    bool is_label_occupied(size_t i) const { return label_occupied[i]; }
+    run_row get_row(unsigned y, unsigned z) const;
+
+private:
+    size_t get_row_index(unsigned y, unsigned z) const;
+    size_t find(size_t run);
+    void join(size_t a, size_t b);
+    void join_rows(unsigned y_a, unsigned z_a, unsigned y_b, unsigned z_b);
+
+    const bitmask& occupancy;
+    glm::uvec3 dim;
+    unsigned z_begin, z_end;
+    // Runs of row r are [row_offset[r], row_offset[r+1]).
+    std::vector<size_t> row_offset;
+    std::unique_ptr<storage> run_data;
+    std::unique_ptr<storage> label_data;
+    uint32_t* run_start;
+    // Parent runs while labeling, labels afterwards
+    size_t* label;
+    std::vector<bool> label_occupied;
+};
+
+components::slab::slab(
+    const bitmask& occupancy,
+    thread_pool& pool,
+    unsigned z_begin,
+    unsigned z_end,
+    size_t first_label
+):  occupancy(occupancy), dim(occupancy.get_dim()),
+    z_begin(z_begin), z_end(z_end),
+    row_offset((size_t)dim.y * (z_end - z_begin) + 1, 0)
+{
+    size_t row_count = row_offset.size() - 1;
+    unsigned row_words = occupancy.get_row_words();
+
+    // Calls f(x) for the start of each run in the row
+    auto for_run_starts = [&](size_t row, auto&& f){
+        const uint64_t* words = occupancy.get_row(
+            row % dim.y, z_begin + row / dim.y
+        );
+        uint64_t carry = words[0] & 1;
+        f(0);
+        for(unsigned w = 0; w < row_words; ++w)
+        {
+            // Bits that differ from the previous bit start a new run
+            uint64_t changes = words[w] ^ ((words[w] << 1) | carry);
+            carry = words[w] >> 63;
+            if(w == row_words - 1 && dim.x % 64)
+                changes &= ~(~(uint64_t)0 << (dim.x % 64));
+            for(; changes; changes &= changes - 1)
+                f(w * 64 + __builtin_ctzll(changes));
+        }
+    };
+
+    pool.parallel_for(row_count, [&](size_t begin, size_t end){
+        for(size_t row = begin; row < end; ++row)
+        {
+            size_t count = 0;
+            for_run_starts(row, [&](unsigned){ count++; });
+            row_offset[row + 1] = count;
+        }
+    });
+    for(size_t row = 0; row < row_count; ++row)
+        row_offset[row + 1] += row_offset[row];
+
+    size_t run_count = row_offset.back();
+    run_data.reset(new storage(run_count, sizeof(uint32_t)));
+    label_data.reset(new storage(run_count, sizeof(size_t)));
+    run_start = run_data->get<uint32_t>();
+    label = label_data->get<size_t>();
+
+    pool.parallel_for(row_count, [&](size_t begin, size_t end){
+        for(size_t row = begin; row < end; ++row)
+        {
+            size_t run = row_offset[row];
+            for_run_starts(row, [&](unsigned x){
+                run_start[run] = x;
+                label[run] = run;
+                run++;
+            });
+        }
+    });
+
+    // Runs only join runs of the same part at first, and join() always
+    // makes the smaller root the parent. Roots therefore stay within each
+    // part and the parts don't interfere.
+    unsigned layers = z_end - z_begin;
+    unsigned part_count = glm::min(layers, pool.get_thread_count() * 4);
+    pool.parallel_for(part_count, [&](size_t begin, size_t end){
+        for(size_t part = begin; part < end; ++part)
+        {
+            unsigned part_begin = z_begin + part * layers / part_count;
+            unsigned part_end = z_begin + (part + 1) * layers / part_count;
+            for(unsigned z = part_begin; z < part_end; ++z)
+            {
+                for(unsigned y = 0; y < dim.y; ++y)
+                {
+                    if(y > 0) join_rows(y-1, z, y, z);
+                    if(z > part_begin) join_rows(y, z-1, y, z);
+                }
+            }
+        }
+    });
+
+    for(unsigned part = 1; part < part_count; ++part)
+    {
+        unsigned z = z_begin + part * layers / part_count;
+        for(unsigned y = 0; y < dim.y; ++y) join_rows(y, z-1, y, z);
+    }
+
+    // Parents always precede their children, so a single pass in order
+    // replaces every parent with the label of its root.
+    for(size_t row = 0; row < row_count; ++row)
+    {
+        bool first_occupied = occupancy.get_row(
+            row % dim.y, z_begin + row / dim.y
+        )[0] & 1;
+        for(size_t run = row_offset[row]; run < row_offset[row + 1]; ++run)
+        {
+            if(label[run] == run)
+            {
+                label[run] = first_label + label_occupied.size();
+                label_occupied.push_back(
+                    first_occupied != ((run - row_offset[row]) & 1)
+                );
+            }
+            else label[run] = label[label[run]];
+        }
+    }
+}
+
+components::run_row components::slab::get_row(unsigned y, unsigned z) const
+{
+    size_t row = get_row_index(y, z);
+    size_t begin = row_offset[row];
+    return run_row{
+        run_start + begin,
+        label + begin,
+        row_offset[row + 1] - begin,
+        (bool)(occupancy.get_row(y, z)[0] & 1),
+        dim.x
+    };
+}
+
+size_t components::slab::get_row_index(unsigned y, unsigned z) const
+{
+    return (size_t)(z - z_begin) * dim.y + y;
+}
+
+size_t components::slab::find(size_t run)
+{
+    while(label[run] != run)
+    {
+        label[run] = label[label[run]];
+        run = label[run];
+    }
+    return run;
+}
+
+void components::slab::join(size_t a, size_t b)
+{
+    a = find(a);
+    b = find(b);
+    if(a < b) label[b] = a;
+    else if(b < a) label[a] = b;
+}
+
+void components::slab::join_rows(
+    unsigned y_a, unsigned z_a, unsigned y_b, unsigned z_b
+){
+    run_row a = get_row(y_a, z_a);
+    run_row b = get_row(y_b, z_b);
+    size_t a_begin = row_offset[get_row_index(y_a, z_a)];
+    size_t b_begin = row_offset[get_row_index(y_b, z_b)];
+    for_overlaps(a, b, [&](size_t i, size_t j, bool same){
+        if(same) join(a_begin + i, b_begin + j);
+    });
+}
+
+components::components(
+    const bitmask& occupancy,
+    thread_pool& pool,
+    unsigned slab_layers,
+    bool keep_cavities
+):  occupancy(occupancy), pool(pool), dim(occupancy.get_dim()),
+    slab_layers(glm::max(slab_layers, 1u)), keep_cavities(keep_cavities)
+{
+    for(unsigned z = 0; z < dim.z; z += this->slab_layers)
+    {
+        slab_labels.push_back(parent.size());
+        slab s(
+            occupancy, pool, z, glm::min(z + this->slab_layers, dim.z),
+            parent.size()
+        );
+        add_slab(s);
+    }
+    classify();
+}
+
+void components::mark_outside(bitmask& outside)
+{
+    for(unsigned i = 0; i < slab_labels.size(); ++i)
+    {
+        unsigned z_begin = i * slab_layers;
+        slab s(
+            occupancy, pool, z_begin, glm::min(z_begin + slab_layers, dim.z),
+            slab_labels[i]
+        );
+
+        size_t row_count = (size_t)dim.y * (s.get_z_end() - z_begin);
+        pool.parallel_for(row_count, [&](size_t begin, size_t end){
+            for(size_t row = begin; row < end; ++row)
+            {
+                unsigned y = row % dim.y, z = z_begin + row / dim.y;
+                if(y == 0 || y == dim.y-1 || z == 0 || z == dim.z-1)
+                {
+                    outside.set_run(y, z, 0, dim.x);
+                    continue;
+                }
+                outside.set(glm::uvec3(0, y, z));
+                outside.set(glm::uvec3(dim.x-1, y, z));
+
+                run_row r = s.get_row(y, z);
+                for(size_t run = 0; run < r.count; ++run)
+                {
+                    if(!r.is_occupied(run) && is_outside[r.label[run]])
+                        outside.set_run(y, z, r.start[run], r.get_end(run));
+                }
+            }
+        });
+    }
+}
+
+template<typename F>
+void components::for_overlaps(const run_row& a, const run_row& b, F&& f)
+{
+    size_t i = 0, j = 0;
+    while(i < a.count && j < b.count)
+    {
+        f(i, j, a.is_occupied(i) == b.is_occupied(j));
+        unsigned a_end = a.get_end(i);
+        unsigned b_end = b.get_end(j);
+        if(a_end <= b_end) i++;
+        if(b_end <= a_end) j++;
+    }
+}
+
+void components::add_slab(const slab& s)
+{
+    size_t first_label = parent.size();
+    size_t end_label = first_label + s.get_label_count();
+    parent.resize(end_label);
+    std::iota(parent.begin() + first_label, parent.end(), first_label);
+    occupied.resize(end_label);
+    for(size_t i = first_label; i < end_label; ++i)
+        occupied[i] = s.is_label_occupied(i - first_label);
+    border.resize(end_label, false);
+
+    auto add_edge = [](std::vector<edge>& edges, size_t a, size_t b){
+        edges.emplace_back(a, b);
+        edges.emplace_back(b, a);
+    };
+
+    // Join with the last layer of the previous slab
+    unsigned z_begin = s.get_z_begin(), z_end = s.get_z_end();
+    if(z_begin > 0)
+    {
+        for(unsigned y = 0; y < dim.y; ++y)
+        {
+            run_row a{
+                boundary_start.data() + boundary_offset[y],
+                boundary_label.data() + boundary_offset[y],
+                boundary_offset[y+1] - boundary_offset[y],
+                boundary_first[y],
+                dim.x
+            };
+            run_row b = s.get_row(y, z_begin);
+            for_overlaps(a, b, [&](size_t i, size_t j, bool same){
+                if(same) join(a.label[i], b.label[j]);
+                else if(keep_cavities)
+                    add_edge(edges, a.label[i], b.label[j]);
+            });
+        }
+    }
+
+    for(unsigned z = z_begin; z < z_end; ++z)
+    {
+        for(unsigned y = 0; y < dim.y; ++y)
+        {
+            run_row r = s.get_row(y, z);
+            if(y == 0 || y == dim.y-1 || z == 0 || z == dim.z-1)
+            {
+                for(size_t run = 0; run < r.count; ++run)
+                    border[r.label[run]] = true;
+            }
+            else
+            {
+                border[r.label[0]] = true;
+                border[r.label[r.count-1]] = true;
+            }
+        }
+    }
+
+    // Gather the pairs of neighboring components in parallel parts. Most
+    // neighboring runs repeat the same pairs, so duplicates are dropped
+    // whenever the list has grown enough.
+    if(keep_cavities)
+    {
+        unsigned layers = z_end - z_begin;
+        unsigned part_count = glm::min(layers, pool.get_thread_count() * 4);
+        std::vector<std::vector<edge>> part_edges(part_count);
+        pool.parallel_for(part_count, [&](size_t begin, size_t end){
+            for(size_t part = begin; part < end; ++part)
+            {
+                std::vector<edge>& e = part_edges[part];
+                size_t compact_size = 0;
+                auto add_different = [&](
+                    const run_row& a, const run_row& b
+                ){
+                    for_overlaps(a, b, [&](size_t i, size_t j, bool same){
+                        if(!same) add_edge(e, a.label[i], b.label[j]);
+                    });
+                };
+
+                unsigned part_begin = z_begin + part * layers / part_count;
+                unsigned part_end = z_begin + (part + 1) * layers / part_count;
+                for(unsigned z = part_begin; z < part_end; ++z)
+                {
+                    for(unsigned y = 0; y < dim.y; ++y)
+                    {
+                        run_row r = s.get_row(y, z);
+                        for(size_t run = 1; run < r.count; ++run)
+                            add_edge(e, r.label[run-1], r.label[run]);
+                        if(y > 0) add_different(s.get_row(y-1, z), r);
+                        if(z > z_begin) add_different(s.get_row(y, z-1), r);
+
+                        if(e.size() > compact_size * 2 + 4096)
+                        {
+                            compact_edges(e);
+                            compact_size = e.size();
+                        }
+                    }
+                }
+                compact_edges(e);
+            }
+        });
+
+        for(std::vector<edge>& e: part_edges)
+            edges.insert(edges.end(), e.begin(), e.end());
+        compact_edges(edges);
+    }
+
+    // Keep the last layer for joining the next slab
+    boundary_offset.assign(1, 0);
+    boundary_start.clear();
+    boundary_label.clear();
+    boundary_first.clear();
+    for(unsigned y = 0; y < dim.y; ++y)
+    {
+        run_row r = s.get_row(y, z_end - 1);
+        boundary_start.insert(boundary_start.end(), r.start, r.start + r.count);
+        boundary_label.insert(boundary_label.end(), r.label, r.label + r.count);
+        boundary_first.push_back(r.first_occupied);
+        boundary_offset.push_back(boundary_start.size());
+    }
+}
+
+void components::classify()
+{
+    // Parents always precede their children, so a single pass in order
+    // points every label directly at its root.
+    for(size_t label = 0; label < parent.size(); ++label)
+    {
+        parent[label] = parent[parent[label]];
+        if(border[label]) border[parent[label]] = true;
+    }
+
+    is_outside.assign(parent.size(), false);
+    if(!keep_cavities)
+    {
+        for(size_t label = 0; label < parent.size(); ++label)
+        {
+            size_t root = parent[label];
+            is_outside[label] = !occupied[root] && border[root];
+        }
+        return;
+    }
+
+    for(edge& e: edges)
+    {
+        e.first = parent[e.first];
+        e.second = parent[e.second];
+    }
+    compact_edges(edges);
+
+    // Breadth-first search over the components, starting from the empty
+    // border components at depth 0 and the occupied ones at depth 1. Depths
+    // are stored plus one, so that zero means unvisited.
+    std::vector<uint32_t> depth(parent.size(), 0);
+    std::deque<size_t> queue;
+    for(unsigned pass = 0; pass < 2; ++pass)
+    {
+        for(size_t label = 0; label < parent.size(); ++label)
+        {
+            if(
+                parent[label] == label && border[label] &&
+                occupied[label] == (pass == 1)
+            ){
+                depth[label] = pass + 1;
+                queue.push_back(label);
+            }
+        }
+    }
+
+    while(!queue.empty())
+    {
+        size_t root = queue.front();
+        queue.pop_front();
+        auto it = std::lower_bound(edges.begin(), edges.end(), edge(root, 0));
+        for(; it != edges.end() && it->first == root; ++it)
+        {
+            if(depth[it->second]) continue;
+            depth[it->second] = depth[root] + 1;
+            queue.push_back(it->second);
+        }
+    }
+
+    // Depths alternate between empty and occupied components, so empty ones
+    // are two steps apart per enclosing surface.
+    for(size_t label = 0; label < parent.size(); ++label)
+    {
+        size_t root = parent[label];
+        is_outside[label] = !occupied[root] && (depth[root] - 1) % 4 == 0;
+    }
+}
+
+size_t components::find(size_t label)
+{
+    while(parent[label] != label)
+    {
+        parent[label] = parent[parent[label]];
+        label = parent[label];
+    }
+    return label;
+}
+
+void components::join(size_t a, size_t b)
+{
+    a = find(a);
+    b = find(b);
+    if(a < b) parent[b] = a;
+    else if(b < a) parent[a] = b;
+}
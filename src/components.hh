@@ -0,0 +1,92 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_COMPONENTS_HH
+#define VOXELSLICER_COMPONENTS_HH
+#include <vector>
+#include "bitmask.hh"
+#include "thread_pool.hh"
+
+/* Connected components of the empty voxels and of the occupied voxels of a
+ * bitmask, with 6-connectivity. The volume is labeled in slabs along z, and
+ * only the labels of one slab are held at a time. Within a slab, voxels are
+ * grouped into runs of equal occupancy along the x-axis, which are joined
+ * with a union-find in parallel. The components of consecutive slabs are
+ * then joined through the labels of the last layer of the earlier slab, so
+ * only a union-find over the components themselves spans the whole volume.
+ */
+class components
+{
+public:
+    /* Labels the volume in slabs of slab_layers layers. keep_cavities also
+     * gathers the neighbors of each component, which are needed to tell
+     * cavities apart.
+     */
+    components(
+        const bitmask& occupancy,
+        thread_pool& pool,
+        unsigned slab_layers,
+        bool keep_cavities
+    );
+    components(const components& other) = delete;
+
+    /* Marks the empty voxels that aren't enclosed by surfaces in 'outside',
+     * along with the whole boundary shell. With keep_cavities, empty regions
+     * enclosed by an even number of nested surfaces are marked as well,
+     * since they are hollow chambers inside the model. The slabs are labeled
+     * again for this, since their labels aren't kept.
+     */
+    void mark_outside(bitmask& outside);
+
+private:
+    class slab;
+    struct run_row;
+
+    // Calls f(a, b, same_occupancy) for each pair of overlapping runs.
+    template<typename F>
+    static void for_overlaps(const run_row& a, const run_row& b, F&& f);
+
+    void add_slab(const slab& s);
+    void classify();
+    size_t find(size_t label);
+    void join(size_t a, size_t b);
+
+    const bitmask& occupancy;
+    thread_pool& pool;
+    glm::uvec3 dim;
+    unsigned slab_layers;
+    bool keep_cavities;
+
+    // First label of each slab
+    std::vector<size_t> slab_labels;
+    // Union-find and properties of the components, indexed by label
+    std::vector<size_t> parent;
+    std::vector<bool> occupied;
+    std::vector<bool> border;
+    std::vector<bool> is_outside;
+    // Neighboring components, only gathered with keep_cavities
+    std::vector<std::pair<size_t, size_t>> edges;
+
+    // Runs and labels of the last layer of the previous slab
+    std::vector<size_t> boundary_offset;
+    std::vector<uint32_t> boundary_start;
+    std::vector<size_t> boundary_label;
+    std::vector<bool> boundary_first;
+};
+
+#endif
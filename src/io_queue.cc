@@ -0,0 +1,378 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "io_queue.hh"
+#ifdef VOXELSLICER_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
+
+// Files in flight at once through io_uring
+#define IO_RING_DEPTH 64
+// Threads writing files without io_uring
+#define IO_THREADS 4
+// Largest single write, below the kernel's limit
+#define IO_MAX_WRITE (1u << 30)
+
+struct io_queue::request
+{
+    std::string path;
+    std::vector<uint8_t> data;
+    int fd = -1;
+    size_t written = 0;
+    iovec iov;
+};
+
+#ifdef VOXELSLICER_IO_URING
+// Added after io_uring itself, so older headers may lack it
+#ifndef IORING_FEAT_SINGLE_MMAP
+#define IORING_FEAT_SINGLE_MMAP (1U << 0)
+#endif
+
+/* Submission and completion rings shared with the kernel, set up with the
+ * raw system calls so that liburing isn't needed.
+ */
+struct io_queue::ring
+{
+    int fd = -1;
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    // Entries queued since the last submission
+    unsigned unsubmitted = 0;
+
+    // Returns false if io_uring is unavailable.
+    bool init(unsigned entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if(fd < 0) return false;
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(
+            nullptr, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING
+        );
+        if(sq_ptr == MAP_FAILED) return false;
+        if(single_mmap) cq_ptr = sq_ptr;
+        else
+        {
+            cq_ptr = mmap(
+                nullptr, cq_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING
+            );
+            if(cq_ptr == MAP_FAILED) return false;
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(
+            nullptr, sqes_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES
+        );
+        if(sqes == MAP_FAILED) return false;
+
+        uint8_t* sq = (uint8_t*)sq_ptr;
+        uint8_t* cq = (uint8_t*)cq_ptr;
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    ~ring()
+    {
+        if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if(fd >= 0) close(fd);
+    }
+
+    // Queues a write of the rest of the request's data.
+    void push_write(request& r)
+    {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        size_t left = r.data.size() - r.written;
+        r.iov.iov_base = r.data.data() + r.written;
+        r.iov.iov_len = left < IO_MAX_WRITE ? left : IO_MAX_WRITE;
+
+        io_uring_sqe& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = r.fd;
+        sqe.addr = (uint64_t)&r.iov;
+        sqe.len = 1;
+        sqe.off = r.written;
+        sqe.user_data = (uint64_t)&r;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+    }
+
+    /* Submits the queued writes and waits for wait_count of them to
+     * complete. Returns false on errors other than interruptions.
+     */
+    bool submit(unsigned wait_count)
+    {
+        int ret = syscall(
+            __NR_io_uring_enter, fd, unsubmitted, wait_count,
+            wait_count ? IORING_ENTER_GETEVENTS : 0, nullptr, 0
+        );
+        if(ret >= 0)
+        {
+            unsubmitted -= ret;
+            return true;
+        }
+        return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+    }
+};
+#else
+// Built without io_uring headers, files are always written by threads
+struct io_queue::ring
+{
+};
+#endif
+
+io_queue::io_queue(size_t max_bytes)
+:   max_bytes(max_bytes), queued_bytes(0), outstanding(0), quit(false)
+{
+#ifdef VOXELSLICER_IO_URING
+    uring.reset(new ring);
+    if(uring->init(IO_RING_DEPTH))
+    {
+        threads.emplace_back(&io_queue::uring_worker, this);
+        return;
+    }
+    uring.reset();
+#endif
+    for(unsigned i = 0; i < IO_THREADS; ++i)
+        threads.emplace_back(&io_queue::thread_worker, this);
+}
+
+io_queue::~io_queue()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+    }
+    request_cv.notify_all();
+    for(std::thread& t: threads) t.join();
+    uring.reset();
+}
+
+void io_queue::write(const std::string& path, std::vector<uint8_t>&& data)
+{
+    std::unique_ptr<request> r(new request);
+    r->path = path;
+    r->data = std::move(data);
+    size_t size = r->data.size();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&]{
+        return queued_bytes == 0 || queued_bytes + size <= max_bytes;
+    });
+    queued_bytes += size;
+    outstanding++;
+    requests.push_back(std::move(r));
+    request_cv.notify_one();
+}
+
+void io_queue::finish()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&]{ return outstanding == 0; });
+    if(!error_path.empty())
+    {
+        std::string path = error_path;
+        error_path.clear();
+        throw std::runtime_error("Unable to write " + path);
+    }
+}
+
+bool io_queue::uses_io_uring() const
+{
+    return uring != nullptr;
+}
+
+#ifdef VOXELSLICER_IO_URING
+void io_queue::uring_worker()
+{
+    std::unordered_set<request*> in_flight;
+    bool broken = false;
+    for(;;)
+    {
+        // New files are only waited for when nothing is being written
+        std::vector<std::unique_ptr<request>> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(in_flight.empty())
+            {
+                request_cv.wait(lock, [&]{
+                    return quit || !requests.empty();
+                });
+                if(requests.empty()) return;
+            }
+            while(
+                !requests.empty() &&
+                in_flight.size() + batch.size() < IO_RING_DEPTH
+            ){
+                batch.push_back(std::move(requests.front()));
+                requests.pop_front();
+            }
+        }
+
+        for(std::unique_ptr<request>& r: batch)
+        {
+            if(!open_request(*r)) end_request(*r, false);
+            else if(broken)
+            {
+                write_request(*r);
+                end_request(*r, r->written == r->data.size());
+            }
+            else
+            {
+                uring->push_write(*r);
+                in_flight.insert(r.release());
+            }
+        }
+        if(in_flight.empty()) continue;
+
+        // The whole batch is submitted with one call
+        if(!uring->submit(1))
+        {
+            // The ring is unusable, so the files are finished with blocking
+            // writes. Rewriting data the kernel already wrote is harmless,
+            // but it may still be reading the buffers, so they are kept
+            // until the ring is closed.
+            broken = true;
+            for(request* p: in_flight)
+            {
+                abandoned.emplace_back(p);
+                write_request(*p);
+                end_request(*p, p->written == p->data.size());
+            }
+            in_flight.clear();
+            continue;
+        }
+
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head)
+        {
+            io_uring_cqe& cqe = uring->cqes[head & uring->cq_mask];
+            request* p = (request*)cqe.user_data;
+            if(cqe.res > 0)
+            {
+                p->written += cqe.res;
+                if(p->written < p->data.size())
+                {
+                    // Short writes continue where they stopped
+                    uring->push_write(*p);
+                    continue;
+                }
+            }
+            in_flight.erase(p);
+            std::unique_ptr<request> r(p);
+            end_request(*r, cqe.res > 0 || r->data.empty());
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+void io_queue::thread_worker()
+{
+    for(;;)
+    {
+        std::unique_ptr<request> r;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            request_cv.wait(lock, [&]{ return quit || !requests.empty(); });
+            if(requests.empty()) return;
+            r = std::move(requests.front());
+            requests.pop_front();
+        }
+        bool ok = open_request(*r);
+        if(ok) write_request(*r);
+        end_request(*r, ok && r->written == r->data.size());
+    }
+}
+
+bool io_queue::open_request(request& r)
+{
+    r.fd = open(r.path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(r.fd < 0) return false;
+    // Preallocating lets the filesystem place the file in one extent; it's
+    // only a hint, so filesystems without fallocate() just skip it.
+    if(!r.data.empty()) fallocate(r.fd, 0, 0, r.data.size());
+    return true;
+}
+
+void io_queue::write_request(request& r)
+{
+    while(r.written < r.data.size())
+    {
+        size_t left = r.data.size() - r.written;
+        ssize_t ret = pwrite(
+            r.fd, r.data.data() + r.written,
+            left < IO_MAX_WRITE ? left : IO_MAX_WRITE, r.written
+        );
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return;
+        r.written += ret;
+    }
+}
+
+void io_queue::end_request(request& r, bool ok)
+{
+    if(r.fd >= 0 && close(r.fd) != 0) ok = false;
+    r.fd = -1;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!ok && error_path.empty()) error_path = r.path;
+    queued_bytes -= r.data.size();
+    outstanding--;
+    done_cv.notify_all();
+}
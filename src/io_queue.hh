@@ -0,0 +1,88 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_IO_QUEUE_HH
+#define VOXELSLICER_IO_QUEUE_HH
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* Writes whole files in the background, so that the threads producing them
+ * don't wait for the disk. Each file is preallocated at its full size
+ * before its data is written. Writes go through io_uring when it was built
+ * in with VOXELSLICER_IO_URING and the kernel supports it, submitting all
+ * queued files at once; otherwise a few threads write them with blocking
+ * calls. Files may complete in any order.
+ */
+class io_queue
+{
+public:
+    // max_bytes bounds the data of the files waiting to be written.
+    explicit io_queue(size_t max_bytes);
+    io_queue(const io_queue& other) = delete;
+    // Waits until queued files are written, ignoring their errors.
+    ~io_queue();
+
+    /* Queues data to be written into a new file, replacing any old one.
+     * Blocks while too much data is already waiting. May be called from any
+     * number of threads at once. Errors are only reported by finish().
+     */
+    void write(const std::string& path, std::vector<uint8_t>&& data);
+
+    /* Waits until all queued files are written, and throws if any of them
+     * couldn't be.
+     */
+    void finish();
+
+    bool uses_io_uring() const;
+
+private:
+    struct request;
+    struct ring;
+
+    void uring_worker();
+    void thread_worker();
+    // Creates and preallocates the file, returns false if that fails.
+    bool open_request(request& r);
+    void write_request(request& r);
+    // Closes the file and counts it as done, without freeing its data.
+    void end_request(request& r, bool ok);
+
+    size_t max_bytes;
+    size_t queued_bytes;
+    size_t outstanding;
+    std::deque<std::unique_ptr<request>> requests;
+    std::unique_ptr<ring> uring;
+    // Requests the kernel may still read, freed after the ring
+    std::vector<std::unique_ptr<request>> abandoned;
+    std::string error_path;
+
+    std::mutex mutex;
+    std::condition_variable request_cv;
+    std::condition_variable done_cv;
+    bool quit;
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,185 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "ktx2.hh"
+#include <algorithm>
+
+#define VK_FORMAT_R8G8B8A8_UNORM 37
+#define KTX2_HEADER_SIZE 80
+#define KTX2_LEVEL_INDEX_SIZE 24
+// Basic data format descriptor block with four samples
+#define KTX2_DFD_BLOCK_SIZE (24 + 4 * 16)
+#define KHR_DF_MODEL_RGBSDA 1
+#define KHR_DF_PRIMARIES_BT709 1
+#define KHR_DF_TRANSFER_LINEAR 1
+#define KHR_DF_CHANNEL_ALPHA 15
+
+static const uint8_t ktx2_identifier[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for(unsigned i = 0; i < 4; ++i) out.push_back(value >> (i*8));
+}
+
+static void put_u64(std::vector<uint8_t>& out, uint64_t value)
+{
+    for(unsigned i = 0; i < 8; ++i) out.push_back(value >> (i*8));
+}
+
+ktx2_layout get_ktx2_layout(glm::uvec3 dim)
+{
+    ktx2_layout layout;
+    glm::uvec3 level = dim;
+    for(;;)
+    {
+        layout.level_dims.push_back(level);
+        if(level == glm::uvec3(1)) break;
+        level = glm::max(level / 2u, glm::uvec3(1));
+    }
+    unsigned level_count = layout.level_dims.size();
+
+    uint32_t dfd_offset = KTX2_HEADER_SIZE +
+        KTX2_LEVEL_INDEX_SIZE * level_count;
+    uint32_t dfd_size = 4 + KTX2_DFD_BLOCK_SIZE;
+
+    // RGBA8 levels are always multiples of 4 bytes, which is all the
+    // alignment they need.
+    std::vector<size_t> level_sizes(level_count);
+    layout.level_offsets.resize(level_count);
+    size_t offset = (dfd_offset + dfd_size + 3) / 4 * 4;
+    for(unsigned i = level_count; i-- > 0;)
+    {
+        glm::uvec3 d = layout.level_dims[i];
+        level_sizes[i] = (size_t)d.x * d.y * d.z * 4;
+        layout.level_offsets[i] = offset;
+        offset += level_sizes[i];
+    }
+    layout.file_size = offset;
+
+    std::vector<uint8_t>& h = layout.header;
+    h.insert(h.end(), ktx2_identifier, ktx2_identifier + 12);
+    put_u32(h, VK_FORMAT_R8G8B8A8_UNORM);
+    put_u32(h, 1);
+    put_u32(h, dim.x);
+    put_u32(h, dim.y);
+    put_u32(h, dim.z);
+    // No array layers, one face, no supercompression
+    put_u32(h, 0);
+    put_u32(h, 1);
+    put_u32(h, level_count);
+    put_u32(h, 0);
+
+    // Data format descriptor, no key/value data or supercompression data
+    put_u32(h, dfd_offset);
+    put_u32(h, dfd_size);
+    put_u32(h, 0);
+    put_u32(h, 0);
+    put_u64(h, 0);
+    put_u64(h, 0);
+
+    for(unsigned i = 0; i < level_count; ++i)
+    {
+        put_u64(h, layout.level_offsets[i]);
+        put_u64(h, level_sizes[i]);
+        put_u64(h, level_sizes[i]);
+    }
+
+    put_u32(h, dfd_size);
+    put_u32(h, 0);
+    put_u32(h, 2 | KTX2_DFD_BLOCK_SIZE << 16);
+    put_u32(h,
+        KHR_DF_MODEL_RGBSDA |
+        KHR_DF_PRIMARIES_BT709 << 8 |
+        KHR_DF_TRANSFER_LINEAR << 16
+    );
+    // 1x1x1 texel blocks of 4 bytes in one plane
+    put_u32(h, 0);
+    put_u32(h, 4);
+    put_u32(h, 0);
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        unsigned channel = i == 3 ? KHR_DF_CHANNEL_ALPHA : i;
+        put_u32(h, i * 8 | 7 << 16 | channel << 24);
+        put_u32(h, 0);
+        put_u32(h, 0);
+        put_u32(h, 255);
+    }
+    h.resize(layout.level_offsets[level_count - 1], 0);
+    return layout;
+}
+
+// Source texels [begin, end) averaged into texel i of an axis
+static void get_footprint(
+    unsigned i, unsigned src_size, unsigned dst_size,
+    unsigned& begin, unsigned& end
+){
+    begin = i * 2;
+    end = i + 1 == dst_size ? src_size : begin + 2;
+}
+
+void downsample_rgba(
+    const uint8_t* src,
+    glm::uvec3 src_dim,
+    uint8_t* dst,
+    glm::uvec3 dst_dim,
+    thread_pool& pool
+){
+    size_t src_row = (size_t)src_dim.x * 4;
+    size_t src_layer = src_row * src_dim.y;
+    pool.parallel_for(
+        (size_t)dst_dim.y * dst_dim.z,
+        [&](size_t begin, size_t end){
+            for(size_t row = begin; row < end; ++row)
+            {
+                unsigned y = row % dst_dim.y, z = row / dst_dim.y;
+                unsigned y0, y1, z0, z1;
+                get_footprint(y, src_dim.y, dst_dim.y, y0, y1);
+                get_footprint(z, src_dim.z, dst_dim.z, z0, z1);
+
+                uint8_t* out = dst + row * dst_dim.x * 4;
+                for(unsigned x = 0; x < dst_dim.x; ++x, out += 4)
+                {
+                    unsigned x0, x1;
+                    get_footprint(x, src_dim.x, dst_dim.x, x0, x1);
+
+                    uint32_t color[3] = {0, 0, 0};
+                    uint32_t alpha = 0, count = 0;
+                    for(unsigned sz = z0; sz < z1; ++sz)
+                    for(unsigned sy = y0; sy < y1; ++sy)
+                    {
+                        const uint8_t* in =
+                            src + sz * src_layer + sy * src_row + x0 * 4;
+                        for(unsigned sx = x0; sx < x1; ++sx, in += 4)
+                        {
+                            for(unsigned c = 0; c < 3; ++c)
+                                color[c] += in[c] * in[3];
+                            alpha += in[3];
+                        }
+                        count += x1 - x0;
+                    }
+
+                    for(unsigned c = 0; c < 3; ++c)
+                        out[c] = alpha ? (color[c] + alpha / 2) / alpha : 0;
+                    out[3] = (alpha + count / 2) / count;
+                }
+            }
+        }
+    );
+}
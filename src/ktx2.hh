@@ -0,0 +1,56 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_KTX2_HH
+#define VOXELSLICER_KTX2_HH
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "thread_pool.hh"
+
+/* Layout of a KTX2 file holding an 8-bit RGBA 3D texture with a full mip
+ * chain. Level 0 is the full size, and each level is half of the previous
+ * one, rounded down, until all axes are 1. The levels are stored smallest
+ * first, as KTX2 requires, after the header.
+ */
+struct ktx2_layout
+{
+    std::vector<uint8_t> header;
+    std::vector<glm::uvec3> level_dims;
+    std::vector<size_t> level_offsets;
+    size_t file_size;
+};
+
+ktx2_layout get_ktx2_layout(glm::uvec3 dim);
+
+/* Box-filters an 8-bit RGBA 3D image into dst, whose size is half of src
+ * rounded down on each axis. Each texel averages 2x2x2 texels, or up to 3
+ * along odd axes so that every source texel counts. Alpha is averaged, and
+ * colors are weighted by their alpha, so transparent texels don't darken
+ * the edges of the opaque ones.
+ */
+void downsample_rgba(
+    const uint8_t* src,
+    glm::uvec3 src_dim,
+    uint8_t* dst,
+    glm::uvec3 dst_dim,
+    thread_pool& pool
+);
+
+#endif
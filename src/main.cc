@@ -21,13 +21,12 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <GL/glew.h>
 #include <iostream>
-#include <iomanip>
-#include <sstream>
 #include <memory>
 #include <getopt.h>
-#include "stb_image_write.h"
 #include "shader.hh"
 #include "model.hh"
+#include "volume.hh"
+#include "output_writer.hh"
 #define GL_MAJOR 3
 #define GL_MINOR 3
 #define HELP 1
@@ -37,6 +36,17 @@
 #define SINGLE 's'
 #define OUTPUT 'o'
 #define FRONT 'r'
+#define SLAB 'z'
+#define THREADS 'j'
+#define CAVITIES 'c'
+#define GPU_FILL 'g'
+#define PARITY 'p'
+#define SDF 'e'
+#define SHELL 'w'
+#define PNG_MODE 'n'
+#define VERBOSE 'v'
+#define FORMAT 't'
+#define CHUNK 'k'
 
 struct
 {
@@ -101,16 +111,6 @@ const std::string vshader_no_texture =
     "    gl_Position = p;\n"
     "}";
 
-enum fill_mode
-{
-    FILL_NONE = 0,
-    FILL_FLATPLUS,
-    FILL_VOLUMEPLUS,
-    FILL_FLATY,
-    FILL_FLATX,
-    FILL_FLATZ
-};
-
 struct
 {
     std::string input_path;
@@ -118,6 +118,17 @@ struct
     fill_mode fill = FILL_NONE;
     bool single_file = false;
     bool front = false;
+    bool keep_cavities = false;
+    bool gpu_fill = false;
+    bool parity = false;
+    sdf_format sdf = SDF_NONE;
+    unsigned shell = 0;
+    output_format format = OUTPUT_PNG;
+    unsigned chunk_size = 64;
+    png_mode png = PNG_SIZE;
+    bool verbose = false;
+    unsigned slab = 0;
+    unsigned threads = 0;
     std::string output_path = "slice";
     glm::ivec3 dim = glm::ivec3(-1);
 } options;
@@ -133,11 +144,23 @@ static bool parse_args(int argc, char** argv)
         { "interpolation", required_argument, NULL, INTERPOLATION },
         { "fill", required_argument, NULL, FILL },
         { "front", no_argument, NULL, FRONT },
+        { "slab", required_argument, NULL, SLAB },
+        { "threads", required_argument, NULL, THREADS },
+        { "keep-cavities", no_argument, NULL, CAVITIES },
+        { "gpu-fill", no_argument, NULL, GPU_FILL },
+        { "parity", no_argument, NULL, PARITY },
+        { "sdf", required_argument, NULL, SDF },
+        { "shell", required_argument, NULL, SHELL },
+        { "format", required_argument, NULL, FORMAT },
+        { "chunk", required_argument, NULL, CHUNK },
+        { "png", required_argument, NULL, PNG_MODE },
+        { "verbose", no_argument, NULL, VERBOSE },
+        { NULL, 0, NULL, 0 }
     };
 
     int val = 0;
     while(
-        (val = getopt_long(argc, argv, "d:o:i:f:sr", longopts, &indexptr)) != -1
+        (val = getopt_long(argc, argv, "d:o:i:f:srz:j:cgpe:w:t:k:n:v", longopts, &indexptr)) != -1
     ){
         char* endptr = optarg-1;
         unsigned axis = 0;
@@ -205,6 +228,100 @@ static bool parse_args(int argc, char** argv)
         case FRONT:
             options.front = true;
             break;
+        case SLAB:
+            options.slab = strtoul(optarg, &endptr, 10);
+            if(*endptr != 0 || options.slab == 0)
+            {
+                printf("Invalid slab size %s\n", optarg);
+                goto help_print;
+            }
+            break;
+        case THREADS:
+            options.threads = strtoul(optarg, &endptr, 10);
+            if(*endptr != 0)
+            {
+                printf("Invalid thread count %s\n", optarg);
+                goto help_print;
+            }
+            break;
+        case CAVITIES:
+            options.keep_cavities = true;
+            break;
+        case GPU_FILL:
+            options.gpu_fill = true;
+            break;
+        case PARITY:
+            options.parity = true;
+            break;
+        case SHELL:
+            options.shell = strtoul(optarg, &endptr, 10);
+            if(*endptr != 0 || options.shell == 0)
+            {
+                printf("Invalid shell thickness %s\n", optarg);
+                goto help_print;
+            }
+            break;
+        case FORMAT:
+            if(!strcmp(optarg, "png"))
+                options.format = OUTPUT_PNG;
+            else if(!strcmp(optarg, "raw"))
+                options.format = OUTPUT_RAW;
+            else if(!strcmp(optarg, "raw-alpha"))
+                options.format = OUTPUT_RAW_ALPHA;
+            else if(!strcmp(optarg, "nrrd"))
+                options.format = OUTPUT_NRRD;
+            else if(!strcmp(optarg, "nrrd-alpha"))
+                options.format = OUTPUT_NRRD_ALPHA;
+            else if(!strcmp(optarg, "vox"))
+                options.format = OUTPUT_VOX;
+            else if(!strcmp(optarg, "ktx2"))
+                options.format = OUTPUT_KTX2;
+            else if(!strcmp(optarg, "tree"))
+                options.format = OUTPUT_TREE;
+            else if(!strcmp(optarg, "chunks"))
+                options.format = OUTPUT_CHUNKS;
+            else if(!strcmp(optarg, "chunkpack"))
+                options.format = OUTPUT_CHUNKS_PACKED;
+            else if(!strcmp(optarg, "zip"))
+                options.format = OUTPUT_ZIP;
+            else {
+                printf("Unknown output format %s\n", optarg);
+                goto help_print;
+            }
+            break;
+        case CHUNK:
+            options.chunk_size = strtoul(optarg, &endptr, 10);
+            if(*endptr != 0 || options.chunk_size == 0)
+            {
+                printf("Invalid chunk size %s\n", optarg);
+                goto help_print;
+            }
+            break;
+        case PNG_MODE:
+            if(!strcmp(optarg, "size"))
+                options.png = PNG_SIZE;
+            else if(!strcmp(optarg, "fast"))
+                options.png = PNG_FAST;
+            else if(!strcmp(optarg, "store"))
+                options.png = PNG_STORE;
+            else {
+                printf("Unknown PNG mode %s\n", optarg);
+                goto help_print;
+            }
+            break;
+        case VERBOSE:
+            options.verbose = true;
+            break;
+        case SDF:
+            if(!strcmp(optarg, "float"))
+                options.sdf = SDF_FLOAT;
+            else if(!strcmp(optarg, "u16"))
+                options.sdf = SDF_U16;
+            else {
+                printf("Unknown distance field format %s\n", optarg);
+                goto help_print;
+            }
+            break;
         case HELP:
             goto help_print;
         default:
@@ -218,12 +335,25 @@ static bool parse_args(int argc, char** argv)
     }
     options.input_path = argv[optind];
 
+    // A shell is a partial fill, so it needs one
+    if(options.shell && options.fill == FILL_NONE)
+        options.fill = FILL_VOLUMEPLUS;
+    // Flat fills only measure distances along some axes, which doesn't give
+    // a shell under the whole surface.
+    if(options.shell && options.fill != FILL_VOLUMEPLUS)
+    {
+        printf("-w only works with the volumeplus fill\n");
+        goto help_print;
+    }
+
     return true;
 
 help_print:
     printf(
         "Usage: %s [-d dimensions] [-o output_prefix] [-i interpolation] "
-        "[-f fill_type] [-s] [-r] model_file\n"
+        "[-f fill_type] [-c] [-g] [-p] [-w shell_voxels] [-e sdf_format] "
+        "[-t format] [-k chunk_size] [-n png_mode] [-s] [-r] "
+        "[-z slab_layers] [-j threads] [-v] model_file\n"
         "\ndimensions defines the size of the output. It can have one of the "
         "following formats:\n"
         "\tWIDTHxHEIGHTxLAYERS\n"
@@ -240,48 +370,71 @@ help_print:
         "\tlinear\n"
         "\tmipmap\n"
         "\n-f enables volume filling. This will fill all volume enclosed by "
-        "the outermost surfaces. It doesn't detect fully enclosed cavities, "
-        "so those will be filled as well. Note that filling may be very "
-        "slow. It can also fail if voxelization contains holes. fill_type may "
-        "be one of the following:\n"
+        "the outermost surfaces, including fully enclosed cavities. It can "
+        "fail if voxelization contains holes. Filled voxels get the color of "
+        "the nearest surface voxel along the axes given by fill_type, which "
+        "may be one of the following:\n"
         "\tflatplus\n"
         "\tvolumeplus\n"
         "\tflatx\n"
         "\tflaty\n"
         "\tflatz\n"
+        "\n-c leaves fully enclosed cavities empty when filling.\n"
+        "\n-g fills on the GPU with compute shaders, if OpenGL 4.3 is "
+        "available. Filling with -c always runs on the CPU.\n"
+        "\n-p decides which voxels are filled while slicing, by counting the "
+        "surfaces above each voxel. Voxels with an odd count are inside. This "
+        "needs a watertight model, but detects cavities and is fast. With -p, "
+        "flatplus, flatx and flaty fills can be used with -z.\n"
+        "\n-w only fills the voxels within shell_voxels voxels of the "
+        "surface, leaving a hollow shell of that thickness. The distance is "
+        "measured along all axes, so fill_type must be volumeplus, which is "
+        "the default with -w.\n"
+        "\n-e writes a signed distance field of the volume into "
+        "output_prefix_sdf.raw, negative inside the model. Insides are found "
+        "like with -f, and -c and -p apply to them as well. sdf_format is "
+        "one of the following:\n"
+        "\tfloat\n"
+        "\tu16\n"
+        "\n-t sets the output format, which is one of the following:\n"
+        "\tpng: one image per layer (default)\n"
+        "\tzip: the same images in one uncompressed output_prefix.zip\n"
+        "\traw: 8-bit RGBA voxels in output_prefix.raw\n"
+        "\traw-alpha: 8-bit alpha in output_prefix.raw\n"
+        "\tnrrd: like raw, with an NRRD header in output_prefix.nrrd\n"
+        "\tnrrd-alpha: like raw-alpha, with an NRRD header\n"
+        "\tvox: MagicaVoxel model in output_prefix.vox\n"
+        "\tktx2: mipmapped 3D texture in output_prefix.ktx2\n"
+        "\ttree: sparse voxel tree in output_prefix.vxt\n"
+        "\tchunks: one raw file per chunk of voxels, named "
+        "output_prefix_X_Y_Z.raw\n"
+        "\tchunkpack: the same chunks packed into output_prefix.vxc\n"
+        "\n-k sets the size of the chunks along each axis, 64 by default.\n"
+        "\n-n sets how the output images are encoded. png_mode is one of "
+        "the following:\n"
+        "\tsize: smallest files, slowest (default)\n"
+        "\tfast: fixed filter and fast compression\n"
+        "\tstore: no compression\n"
         "\n-s enables single-file output. The output layers are arranged "
-        "vertically one after another.\n"
-        "\n-r enables preferring front-face for the z-axis.\n",
+        "vertically one after another. Only applies to PNG output.\n"
+        "\n-r enables preferring front-face for the z-axis.\n"
+        "\n-z enables streaming output. The volume is processed in slabs of "
+        "slab_layers layers, and the layers of each slab are written as soon "
+        "as the slab is finished, while the next slab renders. At most two "
+        "slabs are kept in memory at a time. "
+        "Only png, zip, raw and nrrd formats can be streamed. Cannot be "
+        "combined with -e, -s, or -f except as noted for -p.\n"
+        "\n-j sets the number of worker threads. The default is one per "
+        "core.\n"
+        "\n-v reports the encoding throughput of the output images.\n"
+        "\nVolumes that don't fit in memory are kept in a temporary file in "
+        "$TMPDIR, or /tmp if it isn't set. If that is a tmpfs, the file is "
+        "in memory as well, so point TMPDIR to a disk for such volumes.\n",
         argv[0]
     );
     return false;
 }
 
-static glm::uvec2 except(glm::uvec3 dim, unsigned index)
-{
-    switch(index)
-    {
-    case 0: return glm::uvec2(dim.y, dim.z);
-    case 1: return glm::uvec2(dim.x, dim.z);
-    case 2: return glm::uvec2(dim.x, dim.y);
-    default: return glm::uvec2(0);
-    }
-}
-
-static glm::uvec2 max2(glm::uvec3 dim)
-{
-    if(dim.x < dim.y && dim.x < dim.z) return glm::uvec2(dim.y, dim.z);
-    else if(dim.y < dim.x && dim.y < dim.z) return glm::uvec2(dim.x, dim.z);
-    else return glm::uvec2(dim.x, dim.y);
-}
-
-static int num_len(uint64_t u, int base)
-{
-    size_t len = 1;
-    while((u /= base)) len++;
-    return len;
-}
-
 static bool init(glm::uvec3 dim)
 {
     // Make sure all directions can be rendered to the same buffer
@@ -380,369 +533,6 @@ static void deinit()
     eglTerminate(egl_data.display);
 }
 
-struct voxel
-{
-    glm::vec4 color = glm::vec4(0);
-    unsigned count = 0;
-    unsigned priority = ~0;
-};
-
-class volume
-{
-public:
-    explicit volume(glm::uvec3 dim)
-    :   voxels(new voxel[dim.x*dim.y*dim.z]),
-        dim(dim)
-    {
-        glm::uvec2 sz = max2(dim);
-        unsigned area = sz.x*sz.y;
-        layer_buffer = new uint8_t[area*4];
-        stencil_buffer = new uint8_t[area];
-        priority_buffer = new uint8_t[area];
-        memset(priority_buffer, 0, sizeof(*priority_buffer)*area);
-    }
-
-    volume(const volume& other) = delete;
-
-    ~volume()
-    {
-        delete [] voxels;
-        delete [] layer_buffer;
-        delete [] stencil_buffer;
-        delete [] priority_buffer;
-    }
-
-    voxel& operator[](glm::uvec3 pos) const
-    {
-        voxel* v = voxels + pos.z*dim.x*dim.y + pos.y*dim.x + pos.x;
-        return *v;
-    }
-
-    glm::uvec3 get_dim() const { return dim; }
-
-    glm::uvec2 get_size(unsigned axis) const
-    {
-        return except(dim, axis);
-    }
-
-    glm::uvec3 get_layer_pos(
-        unsigned layer_index, unsigned axis, glm::uvec2 p
-    ) const
-    {
-        switch(axis)
-        {
-        case 0: return glm::uvec3(layer_index, p.x, p.y);
-        case 1: return glm::uvec3(p.x, layer_index, p.y);
-        case 2: return glm::uvec3(p.x, p.y, layer_index);
-        default: return glm::uvec3(0);
-        }
-    }
-
-    void read_gl_priority(unsigned axis)
-    {
-        glm::uvec2 size = get_size(axis);
-        glReadPixels(
-            0, 0,
-            size.x, size.y,
-            GL_RGBA, GL_UNSIGNED_BYTE, layer_buffer
-        );
-        glReadPixels(
-            0, 0,
-            size.x, size.y,
-            GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, stencil_buffer
-        );
-
-        for(unsigned y = 0; y < size.y; ++y)
-        {
-            for(unsigned x = 0; x < size.x; ++x)
-            {
-                unsigned o = x + y * size.x;
-                priority_buffer[o] = stencil_buffer[o] ? layer_buffer[o*4] : 0;
-            }
-        }
-    }
-
-    void read_gl_layer(
-        unsigned layer_index,
-        unsigned axis,
-        bool force_overwrite
-    ){
-        glm::uvec2 size = get_size(axis);
-        glReadPixels(
-            0, 0,
-            size.x, size.y,
-            GL_RGBA, GL_UNSIGNED_BYTE, layer_buffer
-        );
-        glReadPixels(
-            0, 0,
-            size.x, size.y,
-            GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, stencil_buffer
-        );
-
-        for(unsigned y = 0; y < size.y; ++y)
-        {
-            for(unsigned x = 0; x < size.x; ++x)
-            {
-                unsigned o = x + y * size.x;
-                if(stencil_buffer[o] == 0) continue;
-
-                glm::uvec3 pos = get_layer_pos(
-                    layer_index, axis, glm::uvec2(x, y)
-                );
-
-                voxel& v = operator[](pos);
-                glm::vec4 color = {
-                    layer_buffer[o*4], layer_buffer[o*4+1],
-                    layer_buffer[o*4+2], layer_buffer[o*4+3]
-                };
-                color /= 255;
-
-                if(force_overwrite || v.priority > priority_buffer[o])
-                {
-                    v.color = color;
-                    v.count = 1;
-                    v.priority = priority_buffer[o];
-                }
-                else
-                {
-                    v.color = ((float)v.count * v.color + color) /
-                        (v.count + 1.0f);
-                    v.count++;
-                }
-            }
-        }
-    }
-
-    void fill(model& m, fill_mode mode)
-    {
-        glm::vec3 bb_min, bb_max;
-        m.get_bb(bb_min, bb_max);
-        glm::vec3 size = bb_max - bb_min;
-        glm::vec3 weights = glm::vec3(dim)/size;
-
-        bool* outside = new bool[dim.x*dim.y*dim.z];
-        // Set initial value for 'outside'
-        int o = 0;
-        for(unsigned z = 0; z < dim.z; ++z)
-        {
-            for(unsigned y = 0; y < dim.y; ++y)
-            {
-                for(unsigned x = 0; x < dim.x; ++x, ++o)
-                {
-                    outside[o] = 
-                        (x == 0 || x == dim.x-1) ||
-                        (y == 0 || y == dim.y-1) ||
-                        (z == 0 || z == dim.z-1);
-                }
-            }
-        }
-        // Find all outside voxels
-        bool filled_this_iteration;
-        do
-        {
-            filled_this_iteration = false;
-            o = dim.x*dim.y;
-            for(unsigned z = 1; z < dim.z-1; ++z)
-            {
-                o += dim.x;
-                for(unsigned y = 1; y < dim.y-1; ++y)
-                {
-                    ++o;
-                    for(unsigned x = 1; x < dim.x-1; ++x, ++o)
-                    {
-                        if(outside[o]) continue;
-                        // Check neighbors for non-walled outside voxels
-                        int left = o - 1;
-                        int right = o + 1;
-                        int front = o - dim.x;
-                        int back = o + dim.x;
-                        int above = o + dim.x*dim.y;
-                        int below = o - dim.x*dim.y;
-                        if(voxels[o].count)
-                        {
-                            if(
-                                outside[left] ||
-                                outside[right] ||
-                                outside[front] ||
-                                outside[back] ||
-                                outside[above] ||
-                                outside[below]
-                            ) filled_this_iteration = outside[o] = true;
-                        }
-                        else
-                        {
-                            if(
-                                (outside[left] && !voxels[left].count) ||
-                                (outside[right] && !voxels[right].count) ||
-                                (outside[front] && !voxels[front].count) ||
-                                (outside[back] && !voxels[back].count) ||
-                                (outside[above] && !voxels[above].count) ||
-                                (outside[below] && !voxels[below].count)
-                            ) filled_this_iteration = outside[o] = true;
-                        }
-                    }
-                    ++o;
-                }
-                o += dim.x;
-            }
-        }
-        while(filled_this_iteration);
-        // Colorize inside voxels
-        voxel* buf = new voxel[dim.x*dim.y*dim.z];
-        unsigned first_n = 0;
-        unsigned n_len = 0;
-        switch(mode)
-        {
-        case FILL_FLATPLUS:
-            first_n = 0;
-            n_len = 4;
-            break;
-        default:
-        case FILL_VOLUMEPLUS:
-            first_n = 0;
-            n_len = 6;
-            break;
-        case FILL_FLATX:
-            first_n = 0;
-            n_len = 2;
-            break;
-        case FILL_FLATY:
-            first_n = 2;
-            n_len = 2;
-            break;
-        case FILL_FLATZ:
-            first_n = 4;
-            n_len = 2;
-            break;
-        }
-        unsigned end_n = first_n + n_len;
-
-        do
-        {
-            memcpy(buf, voxels, sizeof(voxel)*dim.x*dim.y*dim.z);
-            filled_this_iteration = false;
-            o = dim.x*dim.y;
-            for(unsigned z = 1; z < dim.z-1; ++z)
-            {
-                o += dim.x;
-                for(unsigned y = 1; y < dim.y-1; ++y)
-                {
-                    ++o;
-                    for(unsigned x = 1; x < dim.x-1; ++x, ++o)
-                    {
-                        if(outside[o] || voxels[o].count) continue;
-                        // Check neighbors for walls to average
-                        int neighbors[] = {
-                            o - 1,
-                            o + 1,
-                            o - (int)dim.x,
-                            o + (int)dim.x,
-                            o + (int)(dim.x*dim.y),
-                            o - (int)(dim.x*dim.y)
-                        };
-
-                        glm::vec4 average_color(0);
-                        float count = 0;
-
-                        for(unsigned i = first_n; i < end_n; ++i)
-                        {
-                            int n = neighbors[i];
-                            float weight = weights[i/2];
-                            if(buf[n].count)
-                            {
-                                average_color += buf[n].color*weight;
-                                count += weight;
-                            }
-                        }
-                        if(count == 0.0f) continue;
-                        voxels[o].color = average_color / count;
-                        voxels[o].count = 1;
-                        filled_this_iteration = true;
-                    }
-                    ++o;
-                }
-                o += dim.x;
-            }
-        }
-        while(filled_this_iteration);
-        delete [] buf;
-        delete [] outside;
-    }
-
-    void write_layers(
-        const std::string& path_prefix,
-        unsigned axis,
-        bool single_file
-    ){
-        glm::uvec2 size = get_size(axis);
-        if(single_file)
-        {
-            uint8_t* image_buffer = new uint8_t[dim.x*dim.y*dim.z*4];
-            std::stringstream path;
-            path << path_prefix << ".png";
-            for(unsigned layer = 0; layer < dim[axis]; ++layer)
-            {
-                for(unsigned y = 0; y < size.y; ++y)
-                {
-                    for(unsigned x = 0; x < size.x; ++x)
-                    {
-                        glm::vec4 color = operator[](get_layer_pos(
-                            layer, axis, glm::uvec2(x, y)
-                        )).color;
-                        unsigned o = x + y * size.x + layer * size.x * size.y;
-                        image_buffer[o*4] = color.x*255;
-                        image_buffer[o*4+1] = color.y*255;
-                        image_buffer[o*4+2] = color.z*255;
-                        image_buffer[o*4+3] = color.w*255;
-                    }
-                }
-            }
-            stbi_write_png(
-                path.str().c_str(),
-                size.x, size.y * dim[axis],
-                4, image_buffer, 4*size.x
-            );
-            delete [] image_buffer;
-        }
-        else
-        {
-            unsigned layer_str_width = num_len(dim[axis], 10);
-            for(unsigned layer = 0; layer < dim[axis]; ++layer)
-            {
-                std::stringstream path;
-                path << path_prefix
-                     << std::setw(layer_str_width) << std::setfill('0') << layer
-                     << ".png";
-                for(unsigned y = 0; y < size.y; ++y)
-                {
-                    for(unsigned x = 0; x < size.x; ++x)
-                    {
-                        glm::vec4 color = operator[](get_layer_pos(
-                            layer, axis, glm::uvec2(x, y)
-                        )).color;
-                        unsigned o = x + y * size.x;
-                        layer_buffer[o*4] = color.x*255;
-                        layer_buffer[o*4+1] = color.y*255;
-                        layer_buffer[o*4+2] = color.z*255;
-                        layer_buffer[o*4+3] = color.w*255;
-                    }
-                }
-                stbi_write_png(
-                    path.str().c_str(),
-                    size.x, size.y, 4, layer_buffer, 4*size.x
-                );
-            }
-        }
-    }
-
-private:
-    voxel* voxels;
-    glm::uvec3 dim;
-    uint8_t* layer_buffer;
-    uint8_t* stencil_buffer;
-    uint8_t* priority_buffer;
-};
-
 static glm::uvec3 deduce_dim(glm::ivec3 arg, model& m)
 {
     glm::vec3 res(arg);
@@ -756,10 +546,15 @@ static glm::uvec3 deduce_dim(glm::ivec3 arg, model& m)
     return glm::uvec3(glm::round(res));
 }
 
+/* The x- and y-axis projections only cover the z-range [z_begin, z_end) of
+ * the volume, so that a slab can be rendered without the rest of the volume.
+ */
 static glm::mat4 get_proj(
     glm::uvec3 dim,
     unsigned axis,
     unsigned layer,
+    unsigned z_begin,
+    unsigned z_end,
     model& m
 ){
     glm::vec3 bb_min, bb_max;
@@ -767,6 +562,9 @@ static glm::mat4 get_proj(
     glm::vec3 size = bb_max - bb_min;
 
     float step = size[axis]/dim[axis];
+    float z_step = size.z/dim.z;
+    float z_top = bb_max.z - z_step * z_begin;
+    float z_bottom = bb_max.z - z_step * z_end;
     float far = bb_max[axis] - step * (layer + 1);
     float near = bb_max[axis] - step * layer;
     glm::vec2 left_bottom;
@@ -782,8 +580,8 @@ static glm::mat4 get_proj(
             0,1,0,0,
             0,0,0,1
         );
-        left_bottom = glm::vec2(bb_max.y, bb_max.z);
-        right_top = glm::vec2(bb_min.y, bb_min.z);
+        left_bottom = glm::vec2(bb_max.y, z_top);
+        right_top = glm::vec2(bb_min.y, z_bottom);
         far = bb_min[axis] + step * layer;
         near = bb_min[axis] + step * (layer + 1);
         break;
@@ -794,8 +592,8 @@ static glm::mat4 get_proj(
             0,1,0,0,
             0,0,0,1
         );
-        left_bottom = glm::vec2(bb_min.x, bb_max.z);
-        right_top = glm::vec2(bb_max.x, bb_min.z);
+        left_bottom = glm::vec2(bb_min.x, z_top);
+        right_top = glm::vec2(bb_max.x, z_bottom);
         break;
     default:
     case 2:
@@ -822,6 +620,121 @@ static glm::mat4 get_proj(
     return proj * base;
 }
 
+// Projection of everything above the centers of the voxels of a z-layer
+static glm::mat4 get_parity_proj(glm::uvec3 dim, unsigned layer, model& m)
+{
+    glm::vec3 bb_min, bb_max;
+    m.get_bb(bb_min, bb_max);
+    float step = (bb_max.z - bb_min.z)/dim.z;
+    glm::mat4 base = glm::mat4(
+        1,0,0,0,
+        0,1,0,0,
+        0,0,-1,0,
+        0,0,0,1
+    );
+    glm::mat4 proj = glm::ortho(
+        bb_min.x,
+        bb_max.x,
+        bb_max.y,
+        bb_min.y,
+        bb_max.z + step,
+        bb_max.z - step * (layer + 0.5f)
+    );
+    return proj * base;
+}
+
+static void render_volume(
+    volume& v,
+    model& m,
+    shader& textured,
+    shader& no_texture,
+    shader* priority
+){
+    glm::uvec3 dim = v.get_full_dim();
+    unsigned z_begin = v.get_z_offset();
+    unsigned z_end = z_begin + v.get_dim().z;
+
+    glEnable(GL_CULL_FACE);
+
+    // Render scene from 6 directions
+    for(unsigned dir = 0; dir < 2; ++dir)
+    {
+        glCullFace(dir?GL_FRONT:GL_BACK);
+        glDepthFunc(dir?GL_LEQUAL:GL_GEQUAL);
+        glClearDepth(dir?1:0);
+
+        for(unsigned axis = 0; axis < 3; ++axis)
+        {
+            bool force_overwrite = false;
+            if(options.front && axis == 2)
+            {
+                if(dir == 0) continue;
+                // If this occurs, it's on the last iteration of both loops
+                // so no need to clean up.
+                glDisable(GL_CULL_FACE);
+                force_overwrite = true;
+            }
+            glm::uvec2 size = v.get_size(axis);
+            glViewport(0, 0, size.x, size.y);
+
+            // The z-axis only renders the layers of this slab
+            unsigned first_layer = axis == 2 ? z_begin : 0;
+            unsigned last_layer = axis == 2 ? z_end : dim[axis];
+
+            // Render all layers
+            for(unsigned layer = first_layer; layer < last_layer; ++layer)
+            {
+                glm::mat4 proj(get_proj(dim, axis, layer, z_begin, z_end, m));
+
+                if(priority)
+                {
+                    glClear(
+                        GL_COLOR_BUFFER_BIT |
+                        GL_STENCIL_BUFFER_BIT |
+                        GL_DEPTH_BUFFER_BIT
+                    );
+                    m.draw(proj, priority, nullptr);
+                    v.read_gl_priority(axis);
+                }
+
+                glClear(
+                    GL_COLOR_BUFFER_BIT |
+                    GL_STENCIL_BUFFER_BIT |
+                    GL_DEPTH_BUFFER_BIT
+                );
+                m.draw(proj, &textured, &no_texture);
+
+                v.read_gl_layer(layer - first_layer, axis, force_overwrite);
+            }
+        }
+    }
+
+    // Both filling and the distance field use the inside voxels
+    bool need_inside = options.fill != FILL_NONE || options.sdf != SDF_NONE;
+    if(need_inside && options.parity)
+    {
+        // Every surface above a voxel center flips its stencil, so odd
+        // counts are inside.
+        glDisable(GL_CULL_FACE);
+        glDisable(GL_DEPTH_TEST);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
+
+        glm::uvec2 size = v.get_size(2);
+        glViewport(0, 0, size.x, size.y);
+        for(unsigned layer = z_begin; layer < z_end; ++layer)
+        {
+            glClear(GL_STENCIL_BUFFER_BIT);
+            m.draw(get_parity_proj(dim, layer, m), &textured, &no_texture);
+            v.read_gl_inside(layer - z_begin);
+        }
+
+        glEnable(GL_DEPTH_TEST);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+    }
+}
+
 int main(int argc, char** argv)
 {
     if(!parse_args(argc, argv)) return 1;
@@ -839,11 +752,66 @@ int main(int argc, char** argv)
 
     glm::uvec3 dim = deduce_dim(options.dim, *m);
 
-    // _NOT_ sparse, so large sizes will kill your performance and memory
-    volume v(dim);
+    unsigned slab = options.slab ? glm::min(options.slab, dim.z) : dim.z;
+    // Filling along the z-axis needs the whole volume, and so does finding
+    // the inside voxels without -p.
+    bool layered_fill = options.parity && (
+        options.fill == FILL_FLATPLUS ||
+        options.fill == FILL_FLATX ||
+        options.fill == FILL_FLATY
+    );
+    if(slab < dim.z && options.fill != FILL_NONE && !layered_fill)
+    {
+        std::cerr << "This fill needs the whole volume, it cannot be used "
+            "with streaming output" << std::endl;
+        return 1;
+    }
+    if(slab < dim.z && options.sdf != SDF_NONE)
+    {
+        std::cerr << "Distance fields need the whole volume, they cannot be "
+            "used with streaming output" << std::endl;
+        return 1;
+    }
+    if(slab < dim.z && options.format == OUTPUT_VOX)
+    {
+        std::cerr << "The .vox palette needs the whole volume, it cannot be "
+            "used with streaming output" << std::endl;
+        return 1;
+    }
+    if(slab < dim.z && options.format == OUTPUT_KTX2)
+    {
+        std::cerr << "Mipmaps need the whole volume, they cannot be used "
+            "with streaming output" << std::endl;
+        return 1;
+    }
+    if(slab < dim.z && options.format == OUTPUT_TREE)
+    {
+        std::cerr << "Sparse trees need the whole volume, they cannot be "
+            "used with streaming output" << std::endl;
+        return 1;
+    }
+    if(
+        slab < dim.z && (
+            options.format == OUTPUT_CHUNKS ||
+            options.format == OUTPUT_CHUNKS_PACKED
+        )
+    ){
+        std::cerr << "Chunks need the whole volume, they cannot be used with "
+            "streaming output" << std::endl;
+        return 1;
+    }
+    if(slab < dim.z && options.single_file)
+    {
+        std::cerr << "Single-file output cannot be used with streaming "
+            "output" << std::endl;
+        return 1;
+    }
+
     if(!init(dim))
         return 3;
 
+    int ret = 0;
+    try
     {
         shader no_texture(vshader_no_texture, fshader_no_texture);
         shader textured(vshader_textured, fshader_textured);
@@ -852,7 +820,6 @@ int main(int argc, char** argv)
             priority.reset(new shader(vshader_textured, fshader_priority));
 
         // Both front and back faces in one pass to avoid extra passes
-        glEnable(GL_CULL_FACE);
         glEnable(GL_DEPTH_TEST);
         glEnable(GL_STENCIL_TEST);
         glDisable(GL_BLEND);
@@ -871,61 +838,68 @@ int main(int argc, char** argv)
 
         m->init_gl();
 
-        glm::vec3 bb_min, bb_max;
-        m->get_bb(bb_min, bb_max);
+        thread_pool pool(options.threads);
+        output_writer writer(
+            options.output_path, options.format, options.single_file,
+            options.png, options.chunk_size
+        );
 
-        // Render scene from 6 directions
-        for(unsigned dir = 0; dir < 2; ++dir)
+        // Each slab is rendered and written out separately, and written
+        // while the next one renders. push() only returns once the previous
+        // slab is written and freed, so at most two slabs are in memory at a
+        // time. Without -z, the whole volume is one slab.
+        // _NOT_ sparse, so large slabs will kill your performance and memory
+        for(unsigned z_begin = 0; z_begin < dim.z; z_begin += slab)
         {
-            glCullFace(dir?GL_FRONT:GL_BACK);
-            glDepthFunc(dir?GL_LEQUAL:GL_GEQUAL);
-            glClearDepth(dir?1:0);
-
-            for(unsigned axis = 0; axis < 3; ++axis)
+            unsigned z_end = glm::min(z_begin + slab, dim.z);
+            std::unique_ptr<volume> vp(new volume(dim, z_begin, z_end, pool));
+            volume& v = *vp;
+
+            render_volume(v, *m, textured, no_texture, priority.get());
+            v.finish();
+
+            // The x- and y-axis layers cross every brick of the slab, so the
+            // bricks are only finished once everything is rendered. Filling
+            // and the distance field then work on the compressed bricks, a
+            // few layers at a time, and only the layers being written need
+            // to be decompressed later.
+            v.compress();
+
+            // Filled voxels would count as surface in the distance field
+            if(options.sdf != SDF_NONE)
             {
-                bool force_overwrite = false;
-                if(options.front && axis == 2)
-                {
-                    if(dir == 0) continue;
-                    // If this occurs, it's on the last iteration of both loops
-                    // so no need to clean up.
-                    glDisable(GL_CULL_FACE);
-                    force_overwrite = true;
-                }
-                glm::uvec2 size = v.get_size(axis);
-                glViewport(0, 0, size.x, size.y);
-                // Render all layers
-                for(unsigned layer = 0; layer < dim[axis]; ++layer)
-                {
-                    glm::mat4 proj(get_proj(dim, axis, layer, *m));
-
-                    if(priority)
-                    {
-                        glClear(
-                            GL_COLOR_BUFFER_BIT |
-                            GL_STENCIL_BUFFER_BIT |
-                            GL_DEPTH_BUFFER_BIT
-                        );
-                        m->draw(proj, priority.get(), nullptr);
-                        v.read_gl_priority(axis);
-                    }
+                v.write_sdf(
+                    *m, options.output_path + "_sdf.raw", options.sdf,
+                    options.keep_cavities
+                );
+            }
 
-                    glClear(
-                        GL_COLOR_BUFFER_BIT |
-                        GL_STENCIL_BUFFER_BIT |
-                        GL_DEPTH_BUFFER_BIT
-                    );
-                    m->draw(proj, &textured, &no_texture);
+            if(options.fill != FILL_NONE)
+                v.fill(
+                    *m, options.fill, options.keep_cavities, options.gpu_fill,
+                    options.shell
+                );
 
-                    v.read_gl_layer(layer, axis, force_overwrite);
-                }
-            }
+            writer.push(std::move(vp));
         }
+        writer.finish();
 
-        if(options.fill != FILL_NONE) v.fill(*m, options.fill);
-
-        v.write_layers(options.output_path, 2, options.single_file);
+        if(options.verbose)
+        {
+            png_stats stats = writer.get_stats();
+            double mb = stats.raw_bytes / 1e6;
+            printf(
+                "Encoded %.1f MB of images into %.1f MB in %.2f s, %.1f MB/s\n",
+                mb, stats.encoded_bytes / 1e6, stats.seconds,
+                stats.seconds > 0 ? mb / stats.seconds : 0.0
+            );
+        }
+    }
+    catch(const std::runtime_error& err)
+    {
+        std::cerr << err.what() << std::endl;
+        ret = 4;
     }
     deinit();
-    return 0;
+    return ret;
 }
@@ -0,0 +1,149 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "output_writer.hh"
+
+output_writer::output_writer(
+    const std::string& path_prefix,
+    output_format format,
+    bool single_file,
+    png_mode mode,
+    unsigned chunk_size
+):  path_prefix(path_prefix), format(format), single_file(single_file),
+    mode(mode), chunk_size(chunk_size),
+    archive(
+        format == OUTPUT_ZIP ? new zip_writer(path_prefix + ".zip") : nullptr
+    ),
+    busy(false), quit(false), thread(&output_writer::worker, this)
+{
+}
+
+output_writer::~output_writer()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void output_writer::push(std::unique_ptr<volume>&& v)
+{
+    // Waiting for the previous volume to be written and freed, rather than
+    // only taken, keeps the caller from building a third one meanwhile.
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]{ return (!pending && !busy) || error; });
+    if(error) std::rethrow_exception(error);
+    pending = std::move(v);
+    cv.notify_all();
+}
+
+void output_writer::finish()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]{ return (!pending && !busy) || error; });
+    if(error) std::rethrow_exception(error);
+    if(archive)
+    {
+        archive->finish();
+        archive.reset();
+    }
+}
+
+png_stats output_writer::get_stats()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return stats;
+}
+
+void output_writer::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for(;;)
+    {
+        cv.wait(lock, [&]{ return pending || quit; });
+        if(!pending) return;
+
+        std::unique_ptr<volume> v = std::move(pending);
+        busy = true;
+        cv.notify_all();
+
+        png_stats written = stats;
+        lock.unlock();
+        std::exception_ptr write_error;
+        try
+        {
+            switch(format)
+            {
+            case OUTPUT_PNG:
+                v->write_layers(path_prefix, 2, single_file, mode, written);
+                break;
+            case OUTPUT_RAW:
+            case OUTPUT_RAW_ALPHA:
+                v->write_raw(
+                    path_prefix + ".raw", false, format == OUTPUT_RAW_ALPHA,
+                    written
+                );
+                break;
+            case OUTPUT_NRRD:
+            case OUTPUT_NRRD_ALPHA:
+                v->write_raw(
+                    path_prefix + ".nrrd", true, format == OUTPUT_NRRD_ALPHA,
+                    written
+                );
+                break;
+            case OUTPUT_VOX:
+                v->write_vox(path_prefix + ".vox", written);
+                break;
+            case OUTPUT_KTX2:
+                v->write_ktx2(path_prefix + ".ktx2", written);
+                break;
+            case OUTPUT_TREE:
+                v->write_tree(path_prefix + ".vxt", written);
+                break;
+            case OUTPUT_ZIP:
+                v->write_layers(
+                    path_prefix, 2, false, mode, written, archive.get()
+                );
+                break;
+            case OUTPUT_CHUNKS:
+            case OUTPUT_CHUNKS_PACKED:
+                v->write_chunks(
+                    path_prefix, chunk_size, format == OUTPUT_CHUNKS_PACKED,
+                    written
+                );
+                break;
+            }
+        }
+        catch(...)
+        {
+            write_error = std::current_exception();
+        }
+        // The volume is freed before the next one is taken
+        v.reset();
+        lock.lock();
+
+        busy = false;
+        stats = written;
+        // Volumes queued after an error are dropped unwritten
+        if(write_error && !error) error = write_error;
+        if(error) pending.reset();
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,85 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_OUTPUT_WRITER_HH
+#define VOXELSLICER_OUTPUT_WRITER_HH
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "volume.hh"
+#include "zip.hh"
+
+/* Writes finished volumes in the given format on a thread of its own, so that
+ * writing one slab overlaps rendering and filling the next. Only one volume
+ * is written at a time, and a new one is only accepted once the previous one
+ * is written and freed. Together with the slab being rendered, at most two
+ * slabs are in memory at a time.
+ */
+class output_writer
+{
+public:
+    output_writer(
+        const std::string& path_prefix,
+        output_format format,
+        bool single_file,
+        png_mode mode,
+        unsigned chunk_size
+    );
+    output_writer(const output_writer& other) = delete;
+    // Waits until queued volumes are written, ignoring their errors.
+    ~output_writer();
+
+    /* Queues a finished volume for writing. Blocks until the previous
+     * volume is written, and rethrows the error of an earlier write if one
+     * failed.
+     */
+    void push(std::unique_ptr<volume>&& v);
+
+    /* Waits until all queued volumes are written and rethrows any error.
+     * Archives are completed once all volumes are in them.
+     */
+    void finish();
+
+    // Encoding statistics of the volumes written so far
+    png_stats get_stats();
+
+private:
+    void worker();
+
+    std::string path_prefix;
+    output_format format;
+    bool single_file;
+    png_mode mode;
+    unsigned chunk_size;
+    // Only used by archive formats
+    std::unique_ptr<zip_writer> archive;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unique_ptr<volume> pending;
+    bool busy;
+    bool quit;
+    std::exception_ptr error;
+    png_stats stats;
+    std::thread thread;
+};
+
+#endif
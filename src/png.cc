@@ -0,0 +1,617 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "png.hh"
+#include "stb_image_write.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#define DEFLATE_MIN_MATCH 4
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_CHAIN_PROBES 16
+#define ADLER_BASE 65521
+#define STORED_BLOCK_MAX 65535
+#define IDAT_MAX (1u<<30)
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Deflate bit stream, least significant bit first
+class bit_writer
+{
+public:
+    explicit bit_writer(std::vector<uint8_t>& out): out(out) {}
+
+    void put(uint32_t value, unsigned len)
+    {
+        bits |= (uint64_t)value << count;
+        count += len;
+        while(count >= 8)
+        {
+            out.push_back(bits & 0xFF);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void align() { if(count) put(0, 8 - count); }
+
+private:
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    unsigned count = 0;
+};
+
+// Huffman codes are defined most significant bit first, but stored reversed.
+static uint32_t reverse_bits(uint32_t code, unsigned len)
+{
+    uint32_t res = 0;
+    for(unsigned i = 0; i < len; ++i, code >>= 1)
+        res = (res << 1) | (code & 1);
+    return res;
+}
+
+// The fixed Huffman codes of deflate, already reversed
+struct fixed_codes
+{
+    uint16_t literal[288];
+    uint8_t literal_len[288];
+    uint8_t distance[30];
+    // Length and distance symbols, indexed by length and distance - 1
+    uint8_t length_symbol[DEFLATE_MAX_MATCH + 1];
+
+    fixed_codes()
+    {
+        for(unsigned sym = 0; sym < 288; ++sym)
+        {
+            uint32_t code;
+            unsigned len;
+            if(sym < 144) { code = 0x30 + sym; len = 8; }
+            else if(sym < 256) { code = 0x190 + sym - 144; len = 9; }
+            else if(sym < 280) { code = sym - 256; len = 7; }
+            else { code = 0xC0 + sym - 280; len = 8; }
+            literal[sym] = reverse_bits(code, len);
+            literal_len[sym] = len;
+        }
+        for(unsigned sym = 0; sym < 30; ++sym)
+            distance[sym] = reverse_bits(sym, 5);
+        for(unsigned sym = 0; sym < 29; ++sym)
+        {
+            unsigned end = sym < 28 ? length_base[sym + 1] : 259;
+            for(unsigned len = length_base[sym]; len < end; ++len)
+                length_symbol[len] = sym;
+        }
+    }
+};
+
+static const fixed_codes codes;
+
+static unsigned distance_symbol(unsigned distance)
+{
+    unsigned x = distance - 1;
+    if(x < 4) return x;
+    unsigned n = 31 - __builtin_clz(x);
+    return 2 * n + ((x >> (n - 1)) & 1);
+}
+
+static void put_literal(bit_writer& bw, unsigned sym)
+{
+    bw.put(codes.literal[sym], codes.literal_len[sym]);
+}
+
+static void put_match(bit_writer& bw, unsigned len, unsigned distance)
+{
+    unsigned ls = codes.length_symbol[len];
+    put_literal(bw, 257 + ls);
+    bw.put(len - length_base[ls], length_extra[ls]);
+
+    unsigned ds = distance_symbol(distance);
+    bw.put(codes.distance[ds], 5);
+    bw.put(distance - distance_base[ds], distance_extra[ds]);
+}
+
+/* Ends a run of non-final blocks with an empty stored block, which aligns the
+ * stream to a byte boundary so that independently compressed pieces can be
+ * joined.
+ */
+static void put_sync(bit_writer& bw)
+{
+    bw.put(0, 3);
+    bw.align();
+    bw.put(0, 16);
+    bw.put(0xFFFF, 16);
+}
+
+/* A fixed-Huffman block. Like the brick compressor, matches are found with
+ * one probe into a hash table of the last position of each 4-byte sequence,
+ * and data that doesn't seem to compress is skipped faster.
+ */
+static void deflate_fast(
+    const uint8_t* src,
+    size_t size,
+    std::vector<uint8_t>& out
+){
+    std::vector<uint32_t> table(1<<DEFLATE_HASH_BITS, UINT32_MAX);
+    bit_writer bw(out);
+    bw.put(0, 1);
+    bw.put(1, 2);
+
+    size_t i = 0;
+    size_t anchor = 0;
+    while(i + DEFLATE_MIN_MATCH <= size)
+    {
+        uint32_t seq;
+        memcpy(&seq, src + i, sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = i;
+
+        if(
+            candidate != UINT32_MAX &&
+            i - candidate <= DEFLATE_WINDOW &&
+            memcmp(src + candidate, src + i, DEFLATE_MIN_MATCH) == 0
+        ){
+            size_t max_len = std::min<size_t>(DEFLATE_MAX_MATCH, size - i);
+            size_t len = DEFLATE_MIN_MATCH;
+            while(len < max_len && src[candidate + len] == src[i + len])
+                ++len;
+            for(; anchor < i; ++anchor) put_literal(bw, src[anchor]);
+            put_match(bw, len, i - candidate);
+            i += len;
+            anchor = i;
+        }
+        else i += 1 + ((i - anchor) >> 6);
+    }
+    for(; anchor < size; ++anchor) put_literal(bw, src[anchor]);
+
+    put_literal(bw, 256);
+    put_sync(bw);
+}
+
+/* A fixed-Huffman block with the match search of stb_image_write: chains of
+ * earlier positions with the same 3-byte hash are searched for the longest
+ * match, and a match is dropped for a literal if the next position has a
+ * longer one.
+ */
+static void deflate_size(
+    const uint8_t* src,
+    size_t size,
+    std::vector<uint8_t>& out
+){
+    std::vector<int64_t> head(1<<DEFLATE_HASH_BITS, -1);
+    std::vector<int64_t> prev(DEFLATE_WINDOW, -1);
+    auto hash = [&](size_t i){
+        uint32_t seq = src[i] | src[i+1] << 8 | src[i+2] << 16;
+        return (seq * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+    };
+    auto insert = [&](size_t i){
+        if(i + 3 > size) return;
+        uint32_t h = hash(i);
+        prev[i % DEFLATE_WINDOW] = head[h];
+        head[h] = i;
+    };
+    auto longest = [&](size_t i, size_t& distance){
+        size_t best = 0;
+        if(i + 3 > size) return best;
+        size_t max_len = std::min<size_t>(DEFLATE_MAX_MATCH, size - i);
+        int64_t c = head[hash(i)];
+        for(
+            unsigned probe = 0;
+            probe < DEFLATE_CHAIN_PROBES && c >= 0 &&
+            i - c <= DEFLATE_WINDOW;
+            ++probe, c = prev[c % DEFLATE_WINDOW]
+        ){
+            if(src[c + best] != src[i + best]) continue;
+            size_t len = 0;
+            while(len < max_len && src[c + len] == src[i + len]) ++len;
+            if(len > best)
+            {
+                best = len;
+                distance = i - c;
+                if(len == max_len) break;
+            }
+        }
+        return best >= 3 ? best : 0;
+    };
+
+    bit_writer bw(out);
+    bw.put(0, 1);
+    bw.put(1, 2);
+
+    size_t i = 0;
+    while(i < size)
+    {
+        size_t distance = 0;
+        size_t len = longest(i, distance);
+        insert(i);
+        size_t next_distance = 0;
+        if(len && longest(i + 1, next_distance) <= len)
+        {
+            put_match(bw, len, distance);
+            for(size_t j = i + 1; j < i + len; ++j) insert(j);
+            i += len;
+        }
+        else put_literal(bw, src[i++]);
+    }
+
+    put_literal(bw, 256);
+    put_sync(bw);
+}
+
+static void deflate_store(
+    const uint8_t* src,
+    size_t size,
+    std::vector<uint8_t>& out
+){
+    for(size_t i = 0; i < size;)
+    {
+        size_t len = std::min<size_t>(size - i, STORED_BLOCK_MAX);
+        out.push_back(0);
+        out.push_back(len & 0xFF);
+        out.push_back(len >> 8);
+        out.push_back(~len & 0xFF);
+        out.push_back((~len >> 8) & 0xFF);
+        out.insert(out.end(), src + i, src + i + len);
+        i += len;
+    }
+}
+
+static uint32_t adler32(const uint8_t* data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    while(size > 0)
+    {
+        // Sums can't overflow within this many bytes
+        size_t n = std::min<size_t>(size, 5552);
+        for(size_t i = 0; i < n; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+// Adler-32 of two pieces of data joined, where the second one has len2 bytes
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+    uint32_t rem = len2 % ADLER_BASE;
+    uint32_t a1 = adler1 & 0xFFFF, b1 = adler1 >> 16;
+    uint32_t a2 = adler2 & 0xFFFF, b2 = adler2 >> 16;
+    uint32_t a = (a1 + a2 + ADLER_BASE - 1) % ADLER_BASE;
+    uint32_t b = (
+        (uint64_t)rem * a1 + b1 + b2 + ADLER_BASE - rem
+    ) % ADLER_BASE;
+    return (b << 16) | a;
+}
+
+// Eight bytes at a time with the slicing-by-8 tables of Kounavis and Berry
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc)
+{
+    static const struct crc_tables
+    {
+        uint32_t entries[8][256];
+        crc_tables()
+        {
+            for(uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = n;
+                for(unsigned k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                entries[0][n] = c;
+            }
+            for(unsigned t = 1; t < 8; ++t)
+            for(uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = entries[t-1][n];
+                entries[t][n] = entries[0][c & 0xFF] ^ (c >> 8);
+            }
+        }
+    } tables;
+    const auto& e = tables.entries;
+
+    crc = ~crc;
+    for(; size >= 8; size -= 8, data += 8)
+    {
+        uint32_t lo = crc ^ (
+            data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24
+        );
+        crc = e[7][lo & 0xFF] ^ e[6][(lo >> 8) & 0xFF] ^
+            e[5][(lo >> 16) & 0xFF] ^ e[4][lo >> 24] ^
+            e[3][data[4]] ^ e[2][data[5]] ^ e[1][data[6]] ^ e[0][data[7]];
+    }
+    for(; size > 0; --size, ++data)
+        crc = e[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for(int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(value >> shift);
+}
+
+static void put_chunk(
+    std::vector<uint8_t>& out,
+    const char* type,
+    const uint8_t* data,
+    size_t size
+){
+    put_u32(out, size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_u32(out, crc32(out.data() + start, size + 4));
+}
+
+static void stb_append(void* context, void* data, int size)
+{
+    std::vector<uint8_t>* out = static_cast<std::vector<uint8_t>*>(context);
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    out->insert(out->end(), bytes, bytes + size);
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Applies a PNG filter to a row of RGBA, prev is null for the first row.
+static void filter_row(
+    const uint8_t* row,
+    const uint8_t* prev,
+    size_t row_size,
+    unsigned type,
+    uint8_t* dst
+){
+    // Each filter gets its own loop, these run for every byte of the output
+    size_t first = std::min<size_t>(4, row_size);
+    switch(type)
+    {
+    case 0:
+        memcpy(dst, row, row_size);
+        break;
+    case 1:
+        memcpy(dst, row, first);
+        for(size_t i = 4; i < row_size; ++i) dst[i] = row[i] - row[i - 4];
+        break;
+    case 2:
+        for(size_t i = 0; i < row_size; ++i) dst[i] = row[i] - prev[i];
+        break;
+    case 3:
+        for(size_t i = 0; i < first; ++i) dst[i] = row[i] - (prev[i] >> 1);
+        for(size_t i = 4; i < row_size; ++i)
+            dst[i] = row[i] - ((row[i - 4] + prev[i]) >> 1);
+        break;
+    default:
+        for(size_t i = 0; i < first; ++i) dst[i] = row[i] - prev[i];
+        for(size_t i = 4; i < row_size; ++i)
+            dst[i] = row[i] - paeth(row[i - 4], prev[i], prev[i - 4]);
+        break;
+    }
+}
+
+/* Each row starts with its filter type. The fast mode always uses the up
+ * filter, which turns rows repeating the previous one into zeros, and the
+ * size mode picks the filter with the smallest sum of absolute values like
+ * stb_image_write. The first row of a strip can't refer to the row before it,
+ * since that one is in a different strip.
+ */
+static void filter_rows(
+    const uint8_t* rgba,
+    unsigned width,
+    unsigned rows,
+    png_mode mode,
+    std::vector<uint8_t>& filtered
+){
+    size_t row_size = (size_t)width * 4;
+    filtered.resize((row_size + 1) * rows);
+    std::vector<uint8_t> candidate(row_size);
+    for(unsigned y = 0; y < rows; ++y)
+    {
+        const uint8_t* row = rgba + y * row_size;
+        const uint8_t* prev = y > 0 ? row - row_size : nullptr;
+        uint8_t* dst = filtered.data() + y * (row_size + 1);
+
+        unsigned type = 0;
+        if(mode == PNG_FAST && prev) type = 2;
+        else if(mode == PNG_SIZE)
+        {
+            uint64_t best_cost = UINT64_MAX;
+            for(unsigned t = 0; t < (prev ? 5 : 2); ++t)
+            {
+                filter_row(row, prev, row_size, t, candidate.data());
+                uint64_t cost = 0;
+                for(size_t i = 0; i < row_size; ++i)
+                    cost += abs((int8_t)candidate[i]);
+                if(cost < best_cost)
+                {
+                    best_cost = cost;
+                    type = t;
+                }
+            }
+        }
+        dst[0] = type;
+        filter_row(row, prev, row_size, type, dst + 1);
+    }
+}
+
+void encode_png_strip(
+    const uint8_t* rgba,
+    unsigned width,
+    unsigned rows,
+    png_mode mode,
+    png_strip& strip
+){
+    std::vector<uint8_t> filtered;
+    filter_rows(rgba, width, rows, mode, filtered);
+
+    strip.rows = rows;
+    strip.raw_size = filtered.size();
+    strip.adler = adler32(filtered.data(), filtered.size());
+    strip.data.clear();
+    switch(mode)
+    {
+    case PNG_SIZE:
+        deflate_size(filtered.data(), filtered.size(), strip.data);
+        break;
+    case PNG_FAST:
+        deflate_fast(filtered.data(), filtered.size(), strip.data);
+        break;
+    case PNG_STORE:
+        deflate_store(filtered.data(), filtered.size(), strip.data);
+        break;
+    }
+}
+
+static const uint8_t png_signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+};
+
+// The IHDR of 8-bit RGBA, deflate, adaptive filtering and no interlacing
+static std::vector<uint8_t> png_header(unsigned width, unsigned height)
+{
+    std::vector<uint8_t> header;
+    put_u32(header, width);
+    put_u32(header, height);
+    header.insert(header.end(), {8, 6, 0, 0, 0});
+    return header;
+}
+
+// Deflate with a 32k window and no preset dictionary
+static const uint8_t zlib_header[2] = {0x78, 0x01};
+
+// The final empty block and the Adler-32 of the whole stream
+static std::vector<uint8_t> zlib_trailer(uint32_t adler)
+{
+    std::vector<uint8_t> trailer = {0x01, 0x00, 0x00, 0xFF, 0xFF};
+    put_u32(trailer, adler);
+    return trailer;
+}
+
+void encode_png(
+    const uint8_t* rgba,
+    unsigned width,
+    unsigned height,
+    png_mode mode,
+    std::vector<uint8_t>& out
+){
+    if(mode == PNG_SIZE)
+    {
+        if(!stbi_write_png_to_func(
+            stb_append, &out, width, height, 4, rgba, width * 4
+        )) throw std::runtime_error("Unable to encode PNG");
+        return;
+    }
+
+    png_strip strip;
+    encode_png_strip(rgba, width, height, mode, strip);
+
+    std::vector<uint8_t> idat(zlib_header, zlib_header + 2);
+    idat.insert(idat.end(), strip.data.begin(), strip.data.end());
+    std::vector<uint8_t> trailer = zlib_trailer(strip.adler);
+    idat.insert(idat.end(), trailer.begin(), trailer.end());
+
+    out.insert(out.end(), png_signature, png_signature + 8);
+    std::vector<uint8_t> header = png_header(width, height);
+    put_chunk(out, "IHDR", header.data(), header.size());
+    for(size_t i = 0; i < idat.size(); i += IDAT_MAX)
+    {
+        size_t size = std::min<size_t>(idat.size() - i, IDAT_MAX);
+        put_chunk(out, "IDAT", idat.data() + i, size);
+    }
+    put_chunk(out, "IEND", nullptr, 0);
+}
+
+png_writer::png_writer(
+    const std::string& path,
+    unsigned width,
+    unsigned height
+):  path(path), file(path, std::ios::binary), height(height), rows(0),
+    adler(1)
+{
+    if(!file) throw std::runtime_error("Unable to write " + path);
+    file.write(reinterpret_cast<const char*>(png_signature), 8);
+    std::vector<uint8_t> header = png_header(width, height);
+    write_chunk("IHDR", header.data(), header.size());
+    write_chunk("IDAT", zlib_header, 2);
+}
+
+void png_writer::write(const png_strip& strip)
+{
+    for(size_t i = 0; i < strip.data.size(); i += IDAT_MAX)
+    {
+        size_t size = std::min<size_t>(strip.data.size() - i, IDAT_MAX);
+        write_chunk("IDAT", strip.data.data() + i, size);
+    }
+    adler = adler32_combine(adler, strip.adler, strip.raw_size);
+    rows += strip.rows;
+}
+
+void png_writer::finish()
+{
+    if(rows != height)
+        throw std::runtime_error("Wrong number of rows written to " + path);
+    std::vector<uint8_t> trailer = zlib_trailer(adler);
+    write_chunk("IDAT", trailer.data(), trailer.size());
+    write_chunk("IEND", nullptr, 0);
+    file.close();
+    if(!file) throw std::runtime_error("Unable to write " + path);
+}
+
+void png_writer::write_chunk(
+    const char* type,
+    const uint8_t* data,
+    size_t size
+){
+    std::vector<uint8_t> head;
+    put_u32(head, size);
+    head.insert(head.end(), type, type + 4);
+    std::vector<uint8_t> crc;
+    put_u32(crc, crc32(data, size, crc32(head.data() + 4, 4)));
+
+    file.write(reinterpret_cast<const char*>(head.data()), head.size());
+    file.write(reinterpret_cast<const char*>(data), size);
+    file.write(reinterpret_cast<const char*>(crc.data()), crc.size());
+}
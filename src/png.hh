@@ -0,0 +1,110 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_PNG_HH
+#define VOXELSLICER_PNG_HH
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <fstream>
+
+enum png_mode
+{
+    // stb_image_write with per-row filter search, smallest output
+    PNG_SIZE = 0,
+    /* Fixed filter and a single-probe deflate with fixed Huffman codes,
+     * an order of magnitude faster than PNG_SIZE for slightly larger files
+     */
+    PNG_FAST,
+    // Uncompressed deflate blocks, no filtering
+    PNG_STORE
+};
+
+// Bytes and time spent encoding images, for reporting throughput.
+struct png_stats
+{
+    size_t raw_bytes = 0;
+    size_t encoded_bytes = 0;
+    double seconds = 0;
+};
+
+/* CRC-32 of PNG chunks, which zip files use as well. Pass the CRC of the
+ * preceding data to continue it.
+ */
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+// Appends an 8-bit RGBA image encoded as PNG to out.
+void encode_png(
+    const uint8_t* rgba,
+    unsigned width,
+    unsigned height,
+    png_mode mode,
+    std::vector<uint8_t>& out
+);
+
+
+// Rows of an image compressed into a piece of a PNG data stream
+struct png_strip
+{
+    std::vector<uint8_t> data;
+    unsigned rows = 0;
+    // Size and Adler-32 of the filtered rows before compression
+    size_t raw_size = 0;
+    uint32_t adler = 1;
+};
+
+/* Compresses rows of an 8-bit RGBA image into a strip. Strips don't refer to
+ * each other, so the strips of one image can be encoded in parallel and then
+ * joined with png_writer. Unlike encode_png(), the size mode uses a built-in
+ * compressor, since stb_image_write can only produce whole streams.
+ */
+void encode_png_strip(
+    const uint8_t* rgba,
+    unsigned width,
+    unsigned rows,
+    png_mode mode,
+    png_strip& strip
+);
+
+/* Writes a PNG file strip by strip, so that the whole image never needs to
+ * be in memory at once.
+ */
+class png_writer
+{
+public:
+    png_writer(const std::string& path, unsigned width, unsigned height);
+    png_writer(const png_writer& other) = delete;
+
+    // Appends the next rows of the image.
+    void write(const png_strip& strip);
+
+    // Ends the file once all rows are written.
+    void finish();
+
+private:
+    void write_chunk(const char* type, const uint8_t* data, size_t size);
+
+    std::string path;
+    std::ofstream file;
+    unsigned height;
+    unsigned rows;
+    uint32_t adler;
+};
+
+#endif
@@ -50,26 +50,22 @@ shader::shader(const std::string& vsrc, const std::string& fsrc)
     program = glCreateProgram();
     glAttachShader(program, vshader);
     glAttachShader(program, fshader);
-    glLinkProgram(program);
-
-    GLint status = GL_FALSE;
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
-
-    if(status != GL_TRUE)
-    {
-        GLsizei length = 0;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
-        char* err = new char[length+1];
-        glGetProgramInfoLog(program, length+1, &length, err);
-        std::string err_str(err);
-        delete [] err;
-        throw std::runtime_error(err_str);
-    }
+    link();
 
     glDeleteShader(vshader);
     glDeleteShader(fshader);
 }
 
+shader::shader(const std::string& csrc)
+{
+    GLuint cshader = compile_shader(GL_COMPUTE_SHADER, csrc);
+    program = glCreateProgram();
+    glAttachShader(program, cshader);
+    link();
+
+    glDeleteShader(cshader);
+}
+
 shader::shader(shader&& other)
 : program(other.program)
 {
@@ -90,3 +86,22 @@ void shader::bind()
 {
     glUseProgram(program);
 }
+
+void shader::link()
+{
+    glLinkProgram(program);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+    if(status != GL_TRUE)
+    {
+        GLsizei length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        char* err = new char[length+1];
+        glGetProgramInfoLog(program, length+1, &length, err);
+        std::string err_str(err);
+        delete [] err;
+        throw std::runtime_error(err_str);
+    }
+}
@@ -25,6 +25,8 @@ class shader
 {
 public:
     shader(const std::string& vsrc, const std::string& fsrc);
+    // Compute shader, requires OpenGL 4.3
+    explicit shader(const std::string& csrc);
     shader(shader&& other);
     ~shader();
 
@@ -32,6 +34,8 @@ public:
 
     void bind();
 private:
+    void link();
+
     GLuint program;
 };
 
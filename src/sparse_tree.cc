@@ -0,0 +1,150 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "sparse_tree.hh"
+#include <fstream>
+#include <stdexcept>
+
+#define TREE_VERSION 1
+
+static const size_t lower_children =
+    TREE_LOWER_SIZE * TREE_LOWER_SIZE * TREE_LOWER_SIZE;
+static const size_t upper_children =
+    TREE_UPPER_SIZE * TREE_UPPER_SIZE * TREE_UPPER_SIZE;
+
+tree_node::tree_node()
+: child_mask(lower_children / 64), leaf_count(0), voxel_count(0)
+{
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for(unsigned i = 0; i < 4; ++i) out.push_back(value >> (i*8));
+}
+
+static void put_u64(std::vector<uint8_t>& out, uint64_t value)
+{
+    for(unsigned i = 0; i < 8; ++i) out.push_back(value >> (i*8));
+}
+
+static void put_mask(
+    std::vector<uint8_t>& out,
+    const std::vector<uint64_t>& mask
+){
+    for(uint64_t word: mask) put_u64(out, word);
+}
+
+glm::uvec3 get_lower_node_dim(glm::uvec3 dim)
+{
+    return (dim + glm::uvec3(TREE_LOWER_VOXELS - 1)) /
+        glm::uvec3(TREE_LOWER_VOXELS);
+}
+
+size_t write_sparse_tree(
+    const std::string& path,
+    glm::uvec3 dim,
+    const std::vector<tree_node>& nodes
+){
+    glm::uvec3 lower_dim = get_lower_node_dim(dim);
+    glm::uvec3 upper_dim = (lower_dim + glm::uvec3(TREE_UPPER_SIZE - 1)) /
+        glm::uvec3(TREE_UPPER_SIZE);
+    if(nodes.size() != (size_t)lower_dim.x * lower_dim.y * lower_dim.z)
+        throw std::runtime_error("Sparse tree nodes don't match the volume");
+
+    // Child masks of the upper nodes, only kept for the ones with children
+    std::vector<std::vector<uint64_t>> upper_masks(
+        (size_t)upper_dim.x * upper_dim.y * upper_dim.z
+    );
+    uint64_t leaf_count = 0, voxel_count = 0;
+    unsigned upper_count = 0;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        if(nodes[i].leaf_count == 0) continue;
+        leaf_count += nodes[i].leaf_count;
+        voxel_count += nodes[i].voxel_count;
+
+        glm::uvec3 pos(
+            i % lower_dim.x, i / lower_dim.x % lower_dim.y,
+            i / lower_dim.x / lower_dim.y
+        );
+        glm::uvec3 upper = pos / glm::uvec3(TREE_UPPER_SIZE);
+        glm::uvec3 child = pos % glm::uvec3(TREE_UPPER_SIZE);
+        std::vector<uint64_t>& mask = upper_masks[
+            upper.x + (upper.y + (size_t)upper.z * upper_dim.y) * upper_dim.x
+        ];
+        if(mask.empty())
+        {
+            mask.resize(upper_children / 64);
+            upper_count++;
+        }
+        size_t bit = child.x +
+            (child.y + (size_t)child.z * TREE_UPPER_SIZE) * TREE_UPPER_SIZE;
+        mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+
+    std::vector<uint8_t> head;
+    head.insert(head.end(), {'V', 'X', 'T', 'R'});
+    put_u32(head, TREE_VERSION);
+    for(unsigned i = 0; i < 3; ++i) put_u32(head, dim[i]);
+    put_u32(head, TREE_LEAF_LOG2);
+    put_u32(head, TREE_LOWER_LOG2);
+    put_u32(head, TREE_UPPER_LOG2);
+    put_u32(head, upper_count);
+    put_u64(head, leaf_count);
+    put_u64(head, voxel_count);
+
+    std::ofstream f(path, std::ios::binary);
+    f.write((const char*)head.data(), head.size());
+    size_t size = head.size();
+    for(size_t u = 0; u < upper_masks.size(); ++u)
+    {
+        const std::vector<uint64_t>& mask = upper_masks[u];
+        if(mask.empty()) continue;
+
+        glm::uvec3 upper(
+            u % upper_dim.x, u / upper_dim.x % upper_dim.y,
+            u / upper_dim.x / upper_dim.y
+        );
+        head.clear();
+        for(unsigned i = 0; i < 3; ++i)
+            put_u32(head, upper[i] * TREE_UPPER_VOXELS);
+        put_mask(head, mask);
+        f.write((const char*)head.data(), head.size());
+        size += head.size();
+
+        // Lower nodes in child order
+        for(size_t bit = 0; bit < upper_children; ++bit)
+        {
+            if(!(mask[bit / 64] >> (bit % 64) & 1)) continue;
+            glm::uvec3 pos = upper * glm::uvec3(TREE_UPPER_SIZE) + glm::uvec3(
+                bit % TREE_UPPER_SIZE, bit / TREE_UPPER_SIZE % TREE_UPPER_SIZE,
+                bit / TREE_UPPER_SIZE / TREE_UPPER_SIZE
+            );
+            const tree_node& node = nodes[
+                pos.x + (pos.y + (size_t)pos.z * lower_dim.y) * lower_dim.x
+            ];
+            head.clear();
+            put_mask(head, node.child_mask);
+            f.write((const char*)head.data(), head.size());
+            f.write((const char*)node.leaves.data(), node.leaves.size());
+            size += head.size() + node.leaves.size();
+        }
+    }
+    if(!f) throw std::runtime_error("Unable to write " + path);
+    return size;
+}
@@ -0,0 +1,77 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_SPARSE_TREE_HH
+#define VOXELSLICER_SPARSE_TREE_HH
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Sparse voxel trees are laid out like OpenVDB trees: leaves of 8^3 voxels,
+ * lower nodes of 16^3 leaves and upper nodes of 32^3 lower nodes, so that a
+ * leaf covers 8^3, a lower node 128^3 and an upper node 4096^3 voxels.
+ * Children are indexed with the x-axis varying fastest, then y, then z.
+ */
+#define TREE_LEAF_LOG2 3
+#define TREE_LOWER_LOG2 4
+#define TREE_UPPER_LOG2 5
+#define TREE_LEAF_SIZE (1u << TREE_LEAF_LOG2)
+#define TREE_LOWER_SIZE (1u << TREE_LOWER_LOG2)
+#define TREE_UPPER_SIZE (1u << TREE_UPPER_LOG2)
+// Voxels along each axis of a lower and an upper node
+#define TREE_LOWER_VOXELS (TREE_LEAF_SIZE * TREE_LOWER_SIZE)
+#define TREE_UPPER_VOXELS (TREE_LOWER_VOXELS * TREE_UPPER_SIZE)
+// Bytes in the value mask of a leaf
+#define TREE_LEAF_MASK_BYTES (TREE_LEAF_SIZE * TREE_LEAF_SIZE)
+
+/* Lower node, holding its serialized leaves in child order. Each leaf is a
+ * value mask of one byte per row of 8 voxels, followed by the RGBA values of
+ * the voxels whose bits are set, in bit order.
+ */
+struct tree_node
+{
+    tree_node();
+
+    std::vector<uint64_t> child_mask;
+    std::vector<uint8_t> leaves;
+    size_t leaf_count;
+    size_t voxel_count;
+};
+
+// Size of the grid of lower nodes covering a volume
+glm::uvec3 get_lower_node_dim(glm::uvec3 dim);
+
+/* Writes the lower nodes of a volume of size dim into a sparse tree file.
+ * The nodes form a grid of get_lower_node_dim(dim) nodes, with the x-axis
+ * varying fastest. Nodes without leaves are left out, as are upper nodes
+ * without lower nodes. Returns the size of the file.
+ *
+ * The file starts with the magic "VXTR", a version, dim, the log2 sizes of
+ * the leaves and nodes, the number of upper nodes and the total numbers of
+ * leaves and voxels. Each upper node follows with its origin and child mask,
+ * and then each of its lower nodes with its child mask and leaves.
+ */
+size_t write_sparse_tree(
+    const std::string& path,
+    glm::uvec3 dim,
+    const std::vector<tree_node>& nodes
+);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "storage.hh"
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <atomic>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Anonymous memory currently held by all storages, so that several large
+// allocations don't each assume they have all of the memory to themselves.
+static std::atomic<size_t> anonymous_size(0);
+
+static size_t physical_memory()
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if(pages <= 0 || page_size <= 0) return SIZE_MAX;
+    return (size_t)pages * (size_t)page_size;
+}
+
+static void* map_anonymous(size_t size)
+{
+    void* data = mmap(
+        nullptr, size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0
+    );
+    return data == MAP_FAILED ? nullptr : data;
+}
+
+static void* map_temporary_file(size_t size)
+{
+    const char* tmpdir = getenv("TMPDIR");
+    std::string path = std::string(tmpdir ? tmpdir : "/tmp") +
+        "/voxslice-XXXXXX";
+
+    int fd = mkstemp(&path[0]);
+    if(fd < 0) return nullptr;
+    // The file is only reachable through the mapping, so it disappears
+    // with the process even if we crash.
+    unlink(path.c_str());
+
+    void* data = nullptr;
+    if(ftruncate(fd, size) == 0)
+    {
+        data = mmap(
+            nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0
+        );
+        if(data == MAP_FAILED) data = nullptr;
+    }
+    close(fd);
+    return data;
+}
+
+storage::storage(size_t count, size_t element_size)
+:   data(nullptr), size(checked_product(count, element_size)),
+    type(STORAGE_MEMORY)
+{
+    // mmap() doesn't accept empty mappings
+    if(size == 0) size = 1;
+
+    // The memory is reserved before mapping it, so that allocations made
+    // at the same time can't all fit in the same remaining memory.
+    size_t limit = physical_memory();
+    size_t held = anonymous_size;
+    bool reserved = false;
+    while(size <= limit && held <= limit - size)
+    {
+        if(anonymous_size.compare_exchange_weak(held, held + size))
+        {
+            reserved = true;
+            break;
+        }
+    }
+
+    if(reserved)
+    {
+        data = map_anonymous(size);
+        if(!data) anonymous_size -= size;
+    }
+
+    if(!data)
+    {
+        type = STORAGE_FILE;
+        data = map_temporary_file(size);
+    }
+
+    if(!data)
+        throw std::runtime_error(
+            "Unable to allocate " + std::to_string(size) + " bytes"
+        );
+}
+
+storage::~storage()
+{
+    munmap(data, size);
+    if(type == STORAGE_MEMORY) anonymous_size -= size;
+}
+
+void* storage::get_data() const { return data; }
+
+size_t storage::get_size() const { return size; }
+
+storage::backend storage::get_backend() const { return type; }
+
+void storage::release(size_t offset, size_t length)
+{
+    size_t page_size = sysconf(_SC_PAGE_SIZE);
+    size_t begin = (offset + page_size - 1) / page_size * page_size;
+    size_t end = std::min(offset + length, size) / page_size * page_size;
+    if(begin >= end) return;
+
+    // Private anonymous pages are simply dropped, file pages have to be
+    // punched out of the file to free the disk space.
+    madvise(
+        static_cast<uint8_t*>(data) + begin, end - begin,
+        type == STORAGE_MEMORY ? MADV_DONTNEED : MADV_REMOVE
+    );
+}
+
+size_t checked_product(size_t a, size_t b, size_t c)
+{
+    size_t res;
+    if(
+        __builtin_mul_overflow(a, b, &res) ||
+        __builtin_mul_overflow(res, c, &res)
+    ) throw std::runtime_error("Allocation size overflows");
+    return res;
+}
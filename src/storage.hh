@@ -0,0 +1,64 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_STORAGE_HH
+#define VOXELSLICER_STORAGE_HH
+#include <cstddef>
+#include <cstdint>
+
+/* Zero-initialized storage for large arrays. Allocations that fit in physical
+ * memory are anonymous mappings, which are only committed once touched.
+ * Larger allocations are backed by an unlinked temporary file in $TMPDIR
+ * (/tmp by default), so that they're limited by disk space instead of memory.
+ * Throws std::runtime_error if neither backend can hold the allocation.
+ */
+class storage
+{
+public:
+    enum backend
+    {
+        STORAGE_MEMORY = 0,
+        STORAGE_FILE
+    };
+
+    storage(size_t count, size_t element_size);
+    storage(const storage& other) = delete;
+    ~storage();
+
+    void* get_data() const;
+    size_t get_size() const;
+    backend get_backend() const;
+
+    template<typename T>
+    T* get() const { return static_cast<T*>(get_data()); }
+
+    /* Returns the pages fully inside the given byte range to the system.
+     * They read as zero afterwards.
+     */
+    void release(size_t offset, size_t length);
+
+private:
+    void* data;
+    size_t size;
+    backend type;
+};
+
+// Returns a*b*c, or throws std::runtime_error if the product overflows.
+size_t checked_product(size_t a, size_t b, size_t c = 1);
+
+#endif
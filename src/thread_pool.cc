@@ -0,0 +1,146 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "thread_pool.hh"
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <algorithm>
+
+thread_pool::thread_pool(unsigned thread_count)
+: running(0), quit(false)
+{
+    if(thread_count == 0)
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for(unsigned i = 0; i < thread_count; ++i)
+        threads.emplace_back(&thread_pool::worker, this);
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+    }
+    task_cv.notify_all();
+    for(std::thread& t: threads) t.join();
+}
+
+unsigned thread_pool::get_thread_count() const
+{
+    return threads.size();
+}
+
+void thread_pool::add_task(std::function<void()>&& task)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    task_cv.notify_one();
+}
+
+void thread_pool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&]{ return tasks.empty() && running == 0; });
+}
+
+void thread_pool::parallel_for(
+    size_t count,
+    const std::function<void(size_t begin, size_t end)>& f
+){
+    if(count == 0) return;
+
+    // Several chunks per thread balances uneven work
+    size_t chunk_count = std::min<size_t>(count, threads.size() * 4 + 1);
+    size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+    chunk_count = (count + chunk_size - 1) / chunk_size;
+
+    // Helpers may only get to run after all chunks are done, so the shared
+    // state must outlive this call. f is only called for chunks that were
+    // claimed before that, so referencing it is safe. Once f throws, the
+    // remaining chunks are skipped, and the first error is rethrown here
+    // after the chunks in progress are done.
+    struct state
+    {
+        std::atomic<size_t> next_chunk{0};
+        std::atomic<size_t> finished{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex finish_mutex;
+        std::condition_variable finish_cv;
+    };
+    std::shared_ptr<state> st(new state);
+
+    auto run = [st, chunk_count, chunk_size, count, &f]{
+        size_t chunk;
+        while((chunk = st->next_chunk++) < chunk_count)
+        {
+            size_t begin = chunk * chunk_size;
+            if(!st->failed)
+            {
+                try
+                {
+                    f(begin, std::min(begin + chunk_size, count));
+                }
+                catch(...)
+                {
+                    std::unique_lock<std::mutex> lock(st->finish_mutex);
+                    if(!st->error) st->error = std::current_exception();
+                    st->failed = true;
+                }
+            }
+            if(++st->finished == chunk_count)
+            {
+                std::unique_lock<std::mutex> lock(st->finish_mutex);
+                st->finish_cv.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min<size_t>(threads.size(), chunk_count - 1);
+    for(size_t i = 0; i < helpers; ++i) add_task(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(st->finish_mutex);
+    st->finish_cv.wait(lock, [&]{ return st->finished == chunk_count; });
+    if(st->error) std::rethrow_exception(st->error);
+}
+
+void thread_pool::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for(;;)
+    {
+        task_cv.wait(lock, [&]{ return quit || !tasks.empty(); });
+        if(tasks.empty()) return;
+
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+        running++;
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        running--;
+        if(tasks.empty() && running == 0) done_cv.notify_all();
+    }
+}
@@ -0,0 +1,66 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_THREAD_POOL_HH
+#define VOXELSLICER_THREAD_POOL_HH
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+
+class thread_pool
+{
+public:
+    // A thread count of 0 uses one thread per core.
+    explicit thread_pool(unsigned thread_count = 0);
+    thread_pool(const thread_pool& other) = delete;
+    ~thread_pool();
+
+    unsigned get_thread_count() const;
+
+    void add_task(std::function<void()>&& task);
+
+    // Waits until all tasks added so far have finished.
+    void wait();
+
+    /* Calls f(begin, end) for consecutive ranges covering [0, count) on all
+     * threads, and waits for them to finish. The calling thread takes part in
+     * the work, so this may also be called from within a task. If f throws,
+     * the rest of the ranges are skipped and the first exception is rethrown
+     * once the ranges in progress are done.
+     */
+    void parallel_for(
+        size_t count,
+        const std::function<void(size_t begin, size_t end)>& f
+    );
+
+private:
+    void worker();
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_cv;
+    std::condition_variable done_cv;
+    unsigned running;
+    bool quit;
+};
+
+#endif
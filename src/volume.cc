@@ -0,0 +1,1917 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "volume.hh"
+#include "model.hh"
+#include "components.hh"
+#include "shader.hh"
+#include "png.hh"
+#include "vox.hh"
+#include "ktx2.hh"
+#include "sparse_tree.hh"
+#include "zip.hh"
+#include "io_queue.hh"
+#include <GL/glew.h>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <cmath>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static glm::uvec2 except(glm::uvec3 dim, unsigned index)
+{
+    switch(index)
+    {
+    case 0: return glm::uvec2(dim.y, dim.z);
+    case 1: return glm::uvec2(dim.x, dim.z);
+    case 2: return glm::uvec2(dim.x, dim.y);
+    default: return glm::uvec2(0);
+    }
+}
+
+// Largest layer area of any axis
+static size_t max_area(glm::uvec3 dim)
+{
+    size_t area = 0;
+    for(unsigned axis = 0; axis < 3; ++axis)
+    {
+        glm::uvec2 sz = except(dim, axis);
+        area = glm::max(area, checked_product(sz.x, sz.y));
+    }
+    return area;
+}
+
+static int num_len(uint64_t u, int base)
+{
+    size_t len = 1;
+    while((u /= base)) len++;
+    return len;
+}
+
+/* Outside detection for the GPU fill. Each invocation handles a 32-bit word
+ * of the bit-packed outside mask, which only contains empty voxels. The
+ * first pass marks the empty voxels of the boundary shell, and later passes
+ * grow the mask to empty neighbors until nothing changes.
+ */
+static const std::string flood_shader_src =
+    "#version 430 core\n"
+    "layout(local_size_x = 8, local_size_y = 8) in;\n"
+    "layout(std430, binding = 0) readonly buffer occupancy_buffer {\n"
+    "    uint occupancy[];\n"
+    "};\n"
+    "layout(std430, binding = 1) coherent buffer outside_buffer {\n"
+    "    uint outside[];\n"
+    "};\n"
+    "layout(std430, binding = 2) buffer change_buffer {\n"
+    "    uint changes;\n"
+    "};\n"
+    "uniform uvec3 dim;\n"
+    "uniform uint row_words;\n"
+    "uniform bool init;\n"
+    "void main() {\n"
+    "    uvec3 p = gl_GlobalInvocationID;\n"
+    "    if(p.x >= row_words || p.y >= dim.y || p.z >= dim.z) return;\n"
+    "    uint i = (p.z * dim.y + p.y) * row_words + p.x;\n"
+    "    uint valid = 0u;\n"
+    "    if(p.x * 32u < dim.x) valid = dim.x - p.x * 32u >= 32u ?\n"
+    "        0xFFFFFFFFu : (1u << (dim.x - p.x * 32u)) - 1u;\n"
+    "    uint free_bits = ~occupancy[i] & valid;\n"
+    "    if(init) {\n"
+    "        uint shell = 0u;\n"
+    "        if(p.y == 0u || p.y == dim.y-1u || p.z == 0u || p.z == dim.z-1u)\n"
+    "            shell = 0xFFFFFFFFu;\n"
+    "        if(p.x == 0u) shell |= 1u;\n"
+    "        if(p.x == (dim.x-1u) / 32u) shell |= 1u << ((dim.x-1u) % 32u);\n"
+    "        outside[i] = free_bits & shell;\n"
+    "        return;\n"
+    "    }\n"
+    "    uint old_bits = outside[i];\n"
+    "    uint bits = old_bits;\n"
+    "    if(p.y > 0u) bits |= outside[i - row_words];\n"
+    "    if(p.y < dim.y-1u) bits |= outside[i + row_words];\n"
+    "    if(p.z > 0u) bits |= outside[i - row_words * dim.y];\n"
+    "    if(p.z < dim.z-1u) bits |= outside[i + row_words * dim.y];\n"
+    "    if(p.x > 0u) bits |= outside[i - 1u] >> 31;\n"
+    "    if(p.x < row_words-1u) bits |= outside[i + 1u] << 31;\n"
+    "    bits &= free_bits;\n"
+    "    uint prev_bits;\n"
+    "    do {\n"
+    "        prev_bits = bits;\n"
+    "        bits |= ((bits << 1) | (bits >> 1)) & free_bits;\n"
+    "    } while(bits != prev_bits);\n"
+    "    if(bits != old_bits) {\n"
+    "        atomicOr(outside[i], bits);\n"
+    "        atomicAdd(changes, 1u);\n"
+    "    }\n"
+    "}";
+
+/* Jump flooding for the nearest occupied voxels, with sites stored like in
+ * volume::find_sites(). A step of 0 initializes the sites.
+ */
+static const std::string site_shader_src =
+    "#version 430 core\n"
+    "layout(local_size_x = 8, local_size_y = 8) in;\n"
+    "layout(std430, binding = 0) readonly buffer occupancy_buffer {\n"
+    "    uint occupancy[];\n"
+    "};\n"
+    "layout(std430, binding = 1) readonly buffer src_buffer {\n"
+    "    uint src[];\n"
+    "};\n"
+    "layout(std430, binding = 2) writeonly buffer dst_buffer {\n"
+    "    uint dst[];\n"
+    "};\n"
+    "uniform uvec3 dim;\n"
+    "uniform uint row_words;\n"
+    "uniform uvec3 axes;\n"
+    "uniform vec3 spacing;\n"
+    "uniform int step;\n"
+    "float dist2(uint site, uvec3 p) {\n"
+    "    uvec3 s = uvec3(\n"
+    "        site % dim.x, site / dim.x % dim.y, site / (dim.x * dim.y)\n"
+    "    );\n"
+    "    vec3 d = (vec3(s) - vec3(p)) * spacing;\n"
+    "    return dot(d, d);\n"
+    "}\n"
+    "void main() {\n"
+    "    uvec3 p = gl_GlobalInvocationID;\n"
+    "    if(any(greaterThanEqual(p, dim))) return;\n"
+    "    uint i = (p.z * dim.y + p.y) * dim.x + p.x;\n"
+    "    if(step == 0) {\n"
+    "        uint word = occupancy[(p.z * dim.y + p.y) * row_words + p.x/32u];\n"
+    "        dst[i] = ((word >> (p.x % 32u)) & 1u) != 0u ? i + 1u : 0u;\n"
+    "        return;\n"
+    "    }\n"
+    "    uint best = src[i];\n"
+    "    float best_dist = best != 0u ? dist2(best - 1u, p) : 1.0/0.0;\n"
+    "    ivec3 r = ivec3(axes);\n"
+    "    for(int z = -r.z; z <= r.z; ++z)\n"
+    "    for(int y = -r.y; y <= r.y; ++y)\n"
+    "    for(int x = -r.x; x <= r.x; ++x) {\n"
+    "        ivec3 q = ivec3(p) + ivec3(x, y, z) * step;\n"
+    "        if(\n"
+    "            any(lessThan(q, ivec3(0))) ||\n"
+    "            any(greaterThanEqual(q, ivec3(dim)))\n"
+    "        ) continue;\n"
+    "        uint site = src[(q.z * dim.y + q.y) * dim.x + q.x];\n"
+    "        if(site == 0u) continue;\n"
+    "        float d = dist2(site - 1u, p);\n"
+    "        if(d < best_dist) {\n"
+    "            best = site;\n"
+    "            best_dist = d;\n"
+    "        }\n"
+    "    }\n"
+    "    dst[i] = best;\n"
+    "}";
+
+// Layers read from GL and waiting to be merged may use at most this much
+// memory, regardless of the thread count.
+static const size_t merge_buffer_bytes = (size_t)256 << 20;
+
+volume::volume(
+    glm::uvec3 dim,
+    unsigned z_begin,
+    unsigned z_end,
+    thread_pool& pool
+):  dim(dim.x, dim.y, z_end-z_begin),
+    brick_dim((this->dim + BRICK_SIZE - 1u) / BRICK_SIZE),
+    voxel_data(
+        checked_product(
+            checked_product(brick_dim.x, brick_dim.y, brick_dim.z),
+            BRICK_VOXELS
+        ),
+        sizeof(voxel)
+    ),
+    voxels(voxel_data.get<voxel>()),
+    bricks((size_t)brick_dim.x * brick_dim.y * brick_dim.z),
+    occupancy(this->dim),
+    full_dim(dim),
+    z_offset(z_begin),
+    pool(pool)
+{
+    init_buffers();
+
+    // Two layers per thread keeps the threads busy while the next layers
+    // are rendered, unless their color, stencil and priority buffers would
+    // use too much memory. Two are always allowed, so that one can be merged
+    // while the next is read.
+    size_t job_bytes = std::max<size_t>(max_area(this->dim) * 6, 1);
+    size_t job_count = std::max<size_t>(
+        std::min<size_t>(
+            pool.get_thread_count() * 2, merge_buffer_bytes / job_bytes
+        ),
+        2
+    );
+    for(size_t i = 0; i < job_count; ++i)
+    {
+        jobs.emplace_back(new layer_job);
+        free_jobs.push_back(jobs.back().get());
+    }
+}
+
+volume::~volume()
+{
+    finish();
+    delete [] layer_buffer;
+    delete [] stencil_buffer;
+    delete [] priority_buffer;
+}
+
+voxel& volume::operator[](glm::uvec3 pos) const
+{
+    return voxels[index(pos)];
+}
+
+size_t volume::index(glm::uvec3 pos) const
+{
+    glm::uvec3 b = pos / BRICK_SIZE;
+    glm::uvec3 p = pos % BRICK_SIZE;
+    size_t brick_index = ((size_t)b.z*brick_dim.y + b.y)*brick_dim.x + b.x;
+    return brick_index * BRICK_VOXELS +
+        (p.z*BRICK_SIZE + p.y)*BRICK_SIZE + p.x;
+}
+
+size_t volume::get_index_count() const
+{
+    return bricks.size() * BRICK_VOXELS;
+}
+
+const bitmask& volume::get_occupancy() const
+{
+    return occupancy;
+}
+
+glm::uvec3 volume::get_dim() const { return dim; }
+
+glm::uvec3 volume::get_full_dim() const { return full_dim; }
+
+unsigned volume::get_z_offset() const { return z_offset; }
+
+glm::uvec2 volume::get_size(unsigned axis) const
+{
+    return except(dim, axis);
+}
+
+glm::uvec3 volume::get_layer_pos(
+    unsigned layer_index, unsigned axis, glm::uvec2 p
+) const
+{
+    switch(axis)
+    {
+    case 0: return glm::uvec3(layer_index, p.x, p.y);
+    case 1: return glm::uvec3(p.x, layer_index, p.y);
+    case 2: return glm::uvec3(p.x, p.y, layer_index);
+    default: return glm::uvec3(0);
+    }
+}
+
+void volume::read_gl_priority(unsigned axis)
+{
+    glm::uvec2 size = get_size(axis);
+    glReadPixels(
+        0, 0,
+        size.x, size.y,
+        GL_RGBA, GL_UNSIGNED_BYTE, layer_buffer
+    );
+    glReadPixels(
+        0, 0,
+        size.x, size.y,
+        GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, stencil_buffer
+    );
+
+    for(unsigned y = 0; y < size.y; ++y)
+    {
+        for(unsigned x = 0; x < size.x; ++x)
+        {
+            size_t o = x + (size_t)y * size.x;
+            priority_buffer[o] = stencil_buffer[o] ? layer_buffer[o*4] : 0;
+        }
+    }
+}
+
+void volume::read_gl_layer(
+    unsigned layer_index,
+    unsigned axis,
+    bool force_overwrite
+){
+    layer_job* job;
+    {
+        std::unique_lock<std::mutex> lock(job_mutex);
+        job_cv.wait(lock, [&]{ return !free_jobs.empty(); });
+        job = free_jobs.back();
+        free_jobs.pop_back();
+    }
+
+    glm::uvec2 size = get_size(axis);
+    size_t area = (size_t)size.x * size.y;
+    job->layer_index = layer_index;
+    job->axis = axis;
+    job->force_overwrite = force_overwrite;
+    job->color.resize(area*4);
+    job->stencil.resize(area);
+    job->priority.assign(priority_buffer, priority_buffer + area);
+
+    glReadPixels(
+        0, 0,
+        size.x, size.y,
+        GL_RGBA, GL_UNSIGNED_BYTE, job->color.data()
+    );
+    glReadPixels(
+        0, 0,
+        size.x, size.y,
+        GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, job->stencil.data()
+    );
+
+    pool.add_task([this, job]{
+        merge_layer(
+            job->layer_index, job->axis,
+            job->color.data(), job->stencil.data(), job->priority.data(),
+            job->force_overwrite
+        );
+
+        std::unique_lock<std::mutex> lock(job_mutex);
+        free_jobs.push_back(job);
+        job_cv.notify_all();
+    });
+}
+
+void volume::merge_layer(
+    unsigned layer_index,
+    unsigned axis,
+    const uint8_t* color,
+    const uint8_t* stencil,
+    const uint8_t* priority,
+    bool force_overwrite
+){
+    glm::uvec2 size = get_size(axis);
+    for(unsigned y = 0; y < size.y; ++y)
+    {
+        for(unsigned x = 0; x < size.x; ++x)
+        {
+            size_t o = x + (size_t)y * size.x;
+            if(stencil[o] == 0) continue;
+
+            glm::uvec3 pos = get_layer_pos(
+                layer_index, axis, glm::uvec2(x, y)
+            );
+
+            // Forced samples get the reserved priority 0.
+            unsigned p = force_overwrite ? 0 : glm::min(priority[o] + 1, 255);
+            voxels[index(pos)].merge(color + o*4, p);
+            occupancy.set_atomic(pos);
+        }
+    }
+}
+
+void volume::read_gl_inside(unsigned layer_index)
+{
+    if(!inside) inside.reset(new bitmask(dim));
+
+    glm::uvec2 size = get_size(2);
+    glReadPixels(
+        0, 0,
+        size.x, size.y,
+        GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, stencil_buffer
+    );
+
+    for(unsigned y = 0; y < size.y; ++y)
+    {
+        for(unsigned x = 0; x < size.x; ++x)
+        {
+            if(stencil_buffer[x + (size_t)y * size.x])
+                inside->set(get_layer_pos(layer_index, 2, glm::uvec2(x, y)));
+        }
+    }
+}
+
+void volume::finish()
+{
+    std::unique_lock<std::mutex> lock(job_mutex);
+    job_cv.wait(lock, [&]{ return free_jobs.size() == jobs.size(); });
+}
+
+void volume::compress(unsigned z_begin, unsigned z_end)
+{
+    size_t first, last;
+    get_brick_range(z_begin, z_end, first, last);
+    for(size_t i = first; i < last; ++i)
+    {
+        brick& b = bricks[i];
+        if(b.state == BRICK_PACKED) continue;
+
+        if(b.state == BRICK_DENSE)
+        {
+            glm::uvec3 begin(
+                i % brick_dim.x,
+                i / brick_dim.x % brick_dim.y,
+                i / brick_dim.x / brick_dim.y
+            );
+            begin *= BRICK_SIZE;
+            glm::uvec3 end = glm::min(begin + BRICK_SIZE, dim);
+
+            // Empty bricks are found from the occupancy without touching the
+            // voxels at all.
+            if(occupancy.box_empty(begin, end)) b.packed.clear();
+            // Incompressible bricks just stay dense
+            else if(
+                !encode_brick(get_brick_voxels(i), sizeof(voxel), b.packed)
+            ) continue;
+        }
+
+        b.packed.shrink_to_fit();
+        b.state = BRICK_PACKED;
+        voxel_data.release(
+            i * BRICK_VOXELS * sizeof(voxel), BRICK_VOXELS * sizeof(voxel)
+        );
+    }
+}
+
+void volume::compress()
+{
+    compress(0, dim.z);
+}
+
+void volume::decompress(unsigned z_begin, unsigned z_end, bool modify)
+{
+    size_t first, last;
+    get_brick_range(z_begin, z_end, first, last);
+    for(size_t i = first; i < last; ++i)
+    {
+        brick& b = bricks[i];
+        if(b.state == BRICK_DENSE) continue;
+
+        // Empty bricks need no decoding, released storage reads as zero.
+        if(b.state == BRICK_PACKED && !b.packed.empty())
+            decode_brick(b.packed, sizeof(voxel), get_brick_voxels(i));
+
+        if(modify)
+        {
+            b.packed.clear();
+            b.packed.shrink_to_fit();
+            b.state = BRICK_DENSE;
+        }
+        else b.state = BRICK_CACHED;
+    }
+}
+
+void volume::decompress(bool modify)
+{
+    decompress(0, dim.z, modify);
+}
+
+// Layers of bricks that the CPU fill keeps decompressed at once
+static const unsigned fill_slab_layers = 4 * BRICK_SIZE;
+
+// Nearest occupied voxel of a column above or below some layer
+struct column_site
+{
+    // Layer of the voxel plus one, so that zero means none was found
+    unsigned z;
+    voxel color;
+};
+
+// Scratch memory of transform_line()
+struct transform_buffers
+{
+    std::vector<double> dist2;
+    std::vector<voxel> color;
+    std::vector<unsigned> hull;
+    std::vector<double> bounds;
+};
+
+/* One pass of the separable Euclidean distance transform of Felzenszwalb and
+ * Huttenlocher over n values 'stride' apart. Each value becomes the lowest
+ * dist2[q] + s2 * (p - q)^2 over all q of the line, and takes the color of
+ * that q unless color is null. Infinite distances mark values without a site.
+ */
+template<typename T>
+static void transform_line(
+    T* dist2,
+    voxel* color,
+    unsigned n,
+    size_t stride,
+    double s2,
+    transform_buffers& buf
+){
+    buf.dist2.resize(n);
+    if(color) buf.color.resize(n);
+    buf.hull.resize(n);
+    buf.bounds.resize(n);
+
+    // Lower envelope of the parabolas of the existing sites
+    unsigned k = 0;
+    for(unsigned q = 0; q < n; ++q)
+    {
+        buf.dist2[q] = dist2[q * stride];
+        if(color) buf.color[q] = color[q * stride];
+        if(std::isinf(buf.dist2[q])) continue;
+
+        double fq = buf.dist2[q] + s2 * q * q;
+        double bound = -INFINITY;
+        while(k > 0)
+        {
+            unsigned r = buf.hull[k-1];
+            double fr = buf.dist2[r] + s2 * r * r;
+            bound = (fq - fr) / (2 * s2 * (q - r));
+            if(bound > buf.bounds[k-1]) break;
+            k--;
+        }
+        if(k == 0) bound = -INFINITY;
+        buf.hull[k] = q;
+        buf.bounds[k] = bound;
+        k++;
+    }
+    if(k == 0) return;
+
+    unsigned j = 0;
+    for(unsigned p = 0; p < n; ++p)
+    {
+        while(j + 1 < k && buf.bounds[j+1] <= p) j++;
+        unsigned q = buf.hull[j];
+        double d = (double)p - q;
+        dist2[p * stride] = buf.dist2[q] + s2 * d * d;
+        if(color) color[p * stride] = buf.color[q];
+    }
+}
+
+void volume::fill(
+    model& m,
+    fill_mode mode,
+    bool keep_cavities,
+    bool gpu,
+    unsigned shell_voxels
+){
+    glm::vec3 spacing = get_spacing(m);
+
+    // Shell thickness is counted in voxels of the finest axis
+    double max_dist2 = INFINITY;
+    if(shell_voxels)
+    {
+        double voxel_size = glm::min(spacing.x, glm::min(spacing.y, spacing.z));
+        max_dist2 = shell_voxels * voxel_size;
+        max_dist2 *= max_dist2 * (1 + 1e-6);
+    }
+
+    // The fill mode chooses the axes along which colors spread
+    bool axes[3] = {false, false, false};
+    switch(mode)
+    {
+    case FILL_FLATPLUS:
+        axes[0] = axes[1] = true;
+        break;
+    default:
+    case FILL_VOLUMEPLUS:
+        axes[0] = axes[1] = axes[2] = true;
+        break;
+    case FILL_FLATX:
+        axes[0] = true;
+        break;
+    case FILL_FLATY:
+        axes[1] = true;
+        break;
+    case FILL_FLATZ:
+        axes[2] = true;
+        break;
+    }
+
+    // The GPU path has no cavity detection, but that doesn't matter when the
+    // inside voxels are already known.
+    if(gpu && (!keep_cavities || inside))
+    {
+        if(fill_gpu(axes, spacing, max_dist2)) return;
+        std::cerr << "Compute shaders are unavailable, filling on the CPU\n";
+    }
+
+    bitmask outside(dim);
+    find_outside(outside, keep_cavities);
+    fill_slabs(axes, spacing, max_dist2, outside);
+}
+
+void volume::write_sdf(
+    model& m,
+    const std::string& path,
+    sdf_format format,
+    bool keep_cavities
+){
+    glm::vec3 spacing = get_spacing(m);
+    bitmask outside(dim);
+    find_outside(outside, keep_cavities);
+
+    // Squared distances to the nearest occupied voxel, in linear order
+    size_t area = (size_t)dim.x * dim.y;
+    storage dist_data(checked_product(area, dim.z), sizeof(float));
+    float* dist2 = dist_data.get<float>();
+    pool.parallel_for(dim.z, [&](size_t begin, size_t end){
+        for(unsigned z = begin; z < end; ++z)
+        for(unsigned y = 0; y < dim.y; ++y)
+        for(unsigned x = 0; x < dim.x; ++x)
+        {
+            dist2[x + y * dim.x + z * area] =
+                occupancy.get(glm::uvec3(x, y, z)) ? 0 : INFINITY;
+        }
+    });
+
+    size_t stride[3] = {1, dim.x, area};
+    for(unsigned axis = 0; axis < 3; ++axis)
+    {
+        unsigned a = axis == 0 ? 1 : 0;
+        unsigned b = axis == 2 ? 1 : 2;
+        size_t line_count = (size_t)dim[a] * dim[b];
+        pool.parallel_for(line_count, [&](size_t begin, size_t end){
+            transform_buffers buf;
+            double s2 = spacing[axis] * spacing[axis];
+            for(size_t line = begin; line < end; ++line)
+            {
+                size_t base = line % dim[a] * stride[a] +
+                    line / dim[a] * stride[b];
+                transform_line(
+                    dist2 + base, (voxel*)nullptr, dim[axis], stride[axis],
+                    s2, buf
+                );
+            }
+        });
+    }
+
+    // The quantized format counts in voxels of the finest axis
+    float voxel_size = glm::min(spacing.x, glm::min(spacing.y, spacing.z));
+    size_t value_size = format == SDF_U16 ? sizeof(uint16_t) : sizeof(float);
+    std::vector<uint8_t> layer(area * value_size);
+    std::ofstream f(path, std::ios::binary);
+    for(unsigned z = 0; z < dim.z && f; ++z)
+    {
+        pool.parallel_for(dim.y, [&](size_t begin, size_t end){
+            for(unsigned y = begin; y < end; ++y)
+            {
+                for(unsigned x = 0; x < dim.x; ++x)
+                {
+                    size_t i = x + y * dim.x;
+                    glm::uvec3 pos(x, y, z);
+                    float d = std::sqrt(dist2[i + z * area]);
+                    if(!outside.get(pos) && !occupancy.get(pos)) d = -d;
+
+                    if(format == SDF_U16)
+                    {
+                        float q = glm::round(d / voxel_size * 256.0f);
+                        uint16_t u = glm::clamp(q + 32768.0f, 0.0f, 65535.0f);
+                        memcpy(&layer[i * value_size], &u, value_size);
+                    }
+                    else memcpy(&layer[i * value_size], &d, value_size);
+                }
+            }
+        });
+        f.write((const char*)layer.data(), layer.size());
+    }
+    if(!f) throw std::runtime_error("Unable to write " + path);
+}
+
+glm::vec3 volume::get_spacing(model& m) const
+{
+    glm::vec3 bb_min, bb_max;
+    m.get_bb(bb_min, bb_max);
+    glm::vec3 spacing = (bb_max - bb_min)/glm::vec3(full_dim);
+    for(unsigned axis = 0; axis < 3; ++axis)
+        if(!(spacing[axis] > 0)) spacing[axis] = 1;
+    return spacing;
+}
+
+void volume::find_outside(bitmask& outside, bool keep_cavities)
+{
+    if(inside) mark_not_inside(outside);
+    else
+    {
+        components(
+            occupancy, pool, fill_slab_layers, keep_cavities
+        ).mark_outside(outside);
+    }
+}
+
+bool volume::fill_gpu(
+    const bool axes[3],
+    glm::vec3 spacing,
+    double max_dist2
+){
+    // Sites are the linear positions of the nearest occupied voxels plus one,
+    // so that zero means none was found.
+    storage site_data(checked_product(dim.x, dim.y, dim.z), sizeof(uint64_t));
+    uint64_t* sites = site_data.get<uint64_t>();
+    uint64_t stride[3] = {1, dim.x, (uint64_t)dim.x * dim.y};
+
+    bitmask outside(dim);
+    if(!find_sites_gpu(axes, spacing, outside, sites)) return false;
+    if(inside) mark_not_inside(outside);
+
+    // Colorize empty inside voxels with their nearest occupied voxel, a few
+    // layers at a time. Sites may be anywhere in the volume, so their colors
+    // are read from the compressed bricks through a small cache per thread
+    // instead of decompressing everything. The occupied voxels aren't
+    // modified, so rows can be handled in parallel.
+    unsigned last_word = (dim.x - 1) / 64;
+    uint64_t last_word_mask = ~(uint64_t)0 >> (63 - (dim.x - 1) % 64);
+    for(unsigned z_begin = 0; z_begin < dim.z; z_begin += fill_slab_layers)
+    {
+        unsigned z_end = std::min(z_begin + fill_slab_layers, dim.z);
+        decompress(z_begin, z_end, true);
+        pool.parallel_for(z_end - z_begin, [&](size_t begin, size_t end){
+            brick_cache cache;
+            for(unsigned z = z_begin + begin; z < z_begin + end; ++z)
+            {
+                for(unsigned y = 0; y < dim.y; ++y)
+                {
+                    uint64_t* occupied_row = occupancy.get_row(y, z);
+                    const uint64_t* outside_row = outside.get_row(y, z);
+                    for(unsigned w = 0; w < occupancy.get_row_words(); ++w)
+                    {
+                        uint64_t todo =
+                            ~(outside_row[w] | occupied_row[w]) &
+                            (w == last_word ? last_word_mask : ~(uint64_t)0);
+                        for(; todo; todo &= todo - 1)
+                        {
+                            unsigned x = w * 64 + __builtin_ctzll(todo);
+                            uint64_t site = sites[
+                                x + y * stride[1] + z * stride[2]
+                            ];
+                            if(!site) continue;
+                            glm::uvec3 site_pos = get_linear_pos(site - 1);
+                            glm::vec3 d = spacing * (
+                                glm::vec3(site_pos) - glm::vec3(x, y, z)
+                            );
+                            if(glm::dot(d, d) > max_dist2) continue;
+                            voxels[index(glm::uvec3(x, y, z))] =
+                                read_voxel(site_pos, cache);
+                            occupied_row[w] |= todo & -todo;
+                        }
+                    }
+                }
+            }
+        });
+        compress(z_begin, z_end);
+    }
+    return true;
+}
+
+void volume::mark_not_inside(bitmask& outside) const
+{
+    unsigned last_word = (dim.x - 1) / 64;
+    uint64_t last_word_mask = ~(uint64_t)0 >> (63 - (dim.x - 1) % 64);
+    for(unsigned z = 0; z < dim.z; ++z)
+    {
+        for(unsigned y = 0; y < dim.y; ++y)
+        {
+            uint64_t* outside_row = outside.get_row(y, z);
+            const uint64_t* inside_row = inside->get_row(y, z);
+            for(unsigned w = 0; w < outside.get_row_words(); ++w)
+            {
+                outside_row[w] = ~inside_row[w] &
+                    (w == last_word ? last_word_mask : ~(uint64_t)0);
+            }
+        }
+    }
+}
+
+/* The distance transform is separable, so the nearest occupied voxel along
+ * each z-column can be found first, after which every layer is finished on
+ * its own. Columns are swept once backwards over the slabs, keeping only
+ * their state at each slab boundary, and then forwards while filling. Only
+ * one slab is decompressed at a time, and the remaining memory use is a few
+ * layers per slab.
+ */
+void volume::fill_slabs(
+    const bool axes[3],
+    glm::vec3 spacing,
+    double max_dist2,
+    const bitmask& outside
+){
+    size_t area = (size_t)dim.x * dim.y;
+    unsigned slab_count = (dim.z + fill_slab_layers - 1) / fill_slab_layers;
+    unsigned last_word = (dim.x - 1) / 64;
+    uint64_t last_word_mask = ~(uint64_t)0 >> (63 - (dim.x - 1) % 64);
+
+    // Records the occupied voxels of a layer as the nearest ones of their
+    // columns.
+    auto update_columns = [&](column_site* columns, unsigned z){
+        pool.parallel_for(dim.y, [&](size_t begin, size_t end){
+            for(unsigned y = begin; y < end; ++y)
+            {
+                occupancy.for_each_run(y, z, [&](unsigned xb, unsigned xe){
+                    for(unsigned x = xb; x < xe; ++x)
+                    {
+                        glm::uvec3 pos(x, y, z);
+                        columns[x + y * dim.x] = {z + 1, voxels[index(pos)]};
+                    }
+                });
+            }
+        });
+    };
+
+    // Nearest occupied voxels at or above the first layer of each following
+    // slab, zero-initialized to none.
+    storage above_data(
+        axes[2] ? checked_product(slab_count, area) : 0, sizeof(column_site)
+    );
+    column_site* above = above_data.get<column_site>();
+    if(axes[2])
+    {
+        std::vector<column_site> next(area);
+        for(unsigned s = slab_count; s-- > 0;)
+        {
+            std::copy(next.begin(), next.end(), above + s * area);
+            unsigned z_begin = s * fill_slab_layers;
+            unsigned z_end = std::min(z_begin + fill_slab_layers, dim.z);
+            decompress(z_begin, z_end, false);
+            for(unsigned z = z_end; z-- > z_begin;)
+                update_columns(next.data(), z);
+            compress(z_begin, z_end);
+        }
+    }
+
+    std::vector<column_site> prev(area);
+    // Layers of the nearest occupied voxels at or above each voxel of the
+    // slab, plus one.
+    std::vector<unsigned> next_z;
+    std::vector<double> dist2(area);
+    std::vector<voxel> color(area);
+    for(unsigned s = 0; s < slab_count; ++s)
+    {
+        unsigned z_begin = s * fill_slab_layers;
+        unsigned z_end = std::min(z_begin + fill_slab_layers, dim.z);
+        decompress(z_begin, z_end, true);
+
+        const column_site* slab_above = above + s * area;
+        if(axes[2])
+        {
+            std::vector<column_site> next(slab_above, slab_above + area);
+            next_z.resize((z_end - z_begin) * area);
+            for(unsigned z = z_end; z-- > z_begin;)
+            {
+                update_columns(next.data(), z);
+                unsigned* layer_z = next_z.data() + (z - z_begin) * area;
+                for(size_t i = 0; i < area; ++i) layer_z[i] = next[i].z;
+            }
+        }
+
+        for(unsigned z = z_begin; z < z_end; ++z)
+        {
+            if(axes[2]) update_columns(prev.data(), z);
+
+            // Nearest occupied voxels of the columns, or the occupied voxels
+            // themselves if colors don't spread along z.
+            const unsigned* layer_z = axes[2] ?
+                next_z.data() + (z - z_begin) * area : nullptr;
+            pool.parallel_for(dim.y, [&](size_t begin, size_t end){
+                for(unsigned y = begin; y < end && !axes[2]; ++y)
+                {
+                    size_t row = y * dim.x;
+                    std::fill(&dist2[row], &dist2[row] + dim.x, INFINITY);
+                    occupancy.for_each_run(y, z, [&](unsigned xb, unsigned xe){
+                        for(unsigned x = xb; x < xe; ++x)
+                        {
+                            dist2[row + x] = 0;
+                            color[row + x] = voxels[index(glm::uvec3(x, y, z))];
+                        }
+                    });
+                }
+
+                for(unsigned y = begin; y < end && axes[2]; ++y)
+                for(unsigned x = 0; x < dim.x; ++x)
+                {
+                    size_t i = x + y * dim.x;
+                    double dz = INFINITY;
+                    if(prev[i].z)
+                    {
+                        dz = z - (prev[i].z - 1);
+                        color[i] = prev[i].color;
+                    }
+                    if(layer_z[i] && layer_z[i] - 1 - z < dz)
+                    {
+                        unsigned nz = layer_z[i] - 1;
+                        dz = nz - z;
+                        color[i] = nz < z_end ?
+                            voxels[index(glm::uvec3(x, y, nz))] :
+                            slab_above[i].color;
+                    }
+                    dist2[i] = dz * spacing.z * dz * spacing.z;
+                }
+            });
+
+            if(axes[0])
+            {
+                pool.parallel_for(dim.y, [&](size_t begin, size_t end){
+                    transform_buffers buf;
+                    double s2 = spacing.x * spacing.x;
+                    for(size_t y = begin; y < end; ++y)
+                    {
+                        size_t i = y * dim.x;
+                        transform_line(
+                            &dist2[i], &color[i], dim.x, 1, s2, buf
+                        );
+                    }
+                });
+            }
+
+            if(axes[1])
+            {
+                pool.parallel_for(dim.x, [&](size_t begin, size_t end){
+                    transform_buffers buf;
+                    double s2 = spacing.y * spacing.y;
+                    for(size_t x = begin; x < end; ++x)
+                    {
+                        transform_line(
+                            &dist2[x], &color[x], dim.y, dim.x, s2, buf
+                        );
+                    }
+                });
+            }
+
+            // Empty inside voxels come in long runs, which are filled and
+            // marked occupied a run at a time.
+            pool.parallel_for(dim.y, [&](size_t begin, size_t end){
+                unsigned row_words = occupancy.get_row_words();
+                std::vector<uint64_t> todo(row_words);
+                for(unsigned y = begin; y < end; ++y)
+                {
+                    const uint64_t* occupied_row = occupancy.get_row(y, z);
+                    const uint64_t* outside_row = outside.get_row(y, z);
+                    for(unsigned w = 0; w < row_words; ++w)
+                    {
+                        todo[w] = ~(outside_row[w] | occupied_row[w]) &
+                            (w == last_word ? last_word_mask : ~(uint64_t)0);
+                    }
+
+                    size_t row = y * dim.x;
+                    auto fill_run = [&](unsigned xb, unsigned xe){
+                        unsigned run_begin = xb;
+                        for(unsigned x = xb; x <= xe; ++x)
+                        {
+                            // Voxels without any occupied voxel along the
+                            // fill axes stay empty.
+                            double d = x < xe ? dist2[row + x] : INFINITY;
+                            if(std::isfinite(d) && d <= max_dist2)
+                            {
+                                glm::uvec3 pos(x, y, z);
+                                voxels[index(pos)] = color[row + x];
+                                continue;
+                            }
+                            occupancy.set_run(y, z, run_begin, x);
+                            run_begin = x + 1;
+                        }
+                    };
+                    bitmask::for_each_word_run(
+                        todo.data(), row_words, fill_run
+                    );
+                }
+            });
+        }
+        compress(z_begin, z_end);
+    }
+}
+
+glm::uvec3 volume::get_linear_pos(uint64_t linear) const
+{
+    return glm::uvec3(
+        linear % dim.x, linear / dim.x % dim.y,
+        linear / ((uint64_t)dim.x * dim.y)
+    );
+}
+
+/* Finds the nearest occupied voxel of every voxel and marks the outside
+ * voxels with compute shaders in the current GL context. Jump flooding may
+ * rarely pick a site that isn't quite the nearest. Returns false without
+ * doing anything if the context doesn't support compute shaders or the
+ * volume is too large for it.
+ */
+bool volume::find_sites_gpu(
+    const bool axes[3],
+    glm::vec3 spacing,
+    bitmask& outside,
+    uint64_t* sites
+){
+    size_t voxel_count = (size_t)dim.x * dim.y * dim.z;
+    size_t mask_size = checked_product(
+        occupancy.get_row_words(), (size_t)dim.y * dim.z, sizeof(uint64_t)
+    );
+    unsigned row_words = occupancy.get_row_words() * 2;
+
+    if(!GLEW_VERSION_4_3) return false;
+    GLint64 max_block_size = 0;
+    glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_block_size);
+    if(
+        voxel_count >= UINT_MAX ||
+        voxel_count * sizeof(uint32_t) > (uint64_t)max_block_size ||
+        mask_size > (uint64_t)max_block_size ||
+        dim.z > 65535
+    ) return false;
+
+    std::unique_ptr<shader> flood, jump;
+    try
+    {
+        flood.reset(new shader(flood_shader_src));
+        jump.reset(new shader(site_shader_src));
+    }
+    catch(const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+
+    enum { OCCUPANCY = 0, OUTSIDE, CHANGES, SITES_A, SITES_B, BUFFER_COUNT };
+    GLuint buffers[BUFFER_COUNT];
+    glGenBuffers(BUFFER_COUNT, buffers);
+    GLuint zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[OCCUPANCY]);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER, mask_size, occupancy.get_row(0, 0),
+        GL_STATIC_DRAW
+    );
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[OUTSIDE]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, mask_size, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[CHANGES]);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER, sizeof(zero), &zero, GL_DYNAMIC_READ
+    );
+    for(unsigned i = SITES_A; i <= SITES_B; ++i)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[i]);
+        glBufferData(
+            GL_SHADER_STORAGE_BUFFER, voxel_count * sizeof(uint32_t), NULL,
+            GL_DYNAMIC_COPY
+        );
+    }
+
+    // Flood the outside, checking for changes every few passes since reading
+    // the change count back stalls the pipeline.
+    flood->bind();
+    glUniform3ui(flood->get_uniform("dim"), dim.x, dim.y, dim.z);
+    glUniform1ui(flood->get_uniform("row_words"), row_words);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffers[OCCUPANCY]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffers[OUTSIDE]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, buffers[CHANGES]);
+    glUniform1i(flood->get_uniform("init"), 1);
+    glDispatchCompute((row_words + 7) / 8, (dim.y + 7) / 8, dim.z);
+    glUniform1i(flood->get_uniform("init"), 0);
+    GLuint changes = 0;
+    do
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[CHANGES]);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+        for(unsigned i = 0; i < 16; ++i)
+        {
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            glDispatchCompute((row_words + 7) / 8, (dim.y + 7) / 8, dim.z);
+        }
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glGetBufferSubData(
+            GL_SHADER_STORAGE_BUFFER, 0, sizeof(changes), &changes
+        );
+    }
+    while(changes != 0);
+
+    // Jump flooding with halving steps, and a final extra step of one to fix
+    // most of the remaining errors.
+    jump->bind();
+    glUniform3ui(jump->get_uniform("dim"), dim.x, dim.y, dim.z);
+    glUniform1ui(jump->get_uniform("row_words"), row_words);
+    glUniform3ui(jump->get_uniform("axes"), axes[0], axes[1], axes[2]);
+    glUniform3f(
+        jump->get_uniform("spacing"), spacing.x, spacing.y, spacing.z
+    );
+    unsigned max_dim = 1;
+    for(unsigned axis = 0; axis < 3; ++axis)
+        if(axes[axis]) max_dim = glm::max(max_dim, dim[axis]);
+    std::vector<int> steps = {0};
+    for(unsigned step = 1; step < max_dim; step *= 2)
+        steps.insert(steps.begin() + 1, step);
+    steps.push_back(1);
+
+    unsigned src = SITES_B, dst = SITES_A;
+    for(int step: steps)
+    {
+        glUniform1i(jump->get_uniform("step"), step);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffers[src]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, buffers[dst]);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        glDispatchCompute((dim.x + 7) / 8, (dim.y + 7) / 8, dim.z);
+        std::swap(src, dst);
+    }
+
+    // Running out of GPU memory shows up as an error here
+    bool ok = glGetError() == GL_NO_ERROR;
+    const uint32_t* gpu_sites = nullptr;
+    if(ok)
+    {
+        glMemoryBarrier(
+            GL_BUFFER_UPDATE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT
+        );
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[OUTSIDE]);
+        glGetBufferSubData(
+            GL_SHADER_STORAGE_BUFFER, 0, mask_size, outside.get_row(0, 0)
+        );
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[src]);
+        gpu_sites = static_cast<const uint32_t*>(glMapBufferRange(
+            GL_SHADER_STORAGE_BUFFER, 0, voxel_count * sizeof(uint32_t),
+            GL_MAP_READ_BIT
+        ));
+        ok = gpu_sites != nullptr;
+    }
+    if(ok)
+    {
+        pool.parallel_for(voxel_count, [&](size_t begin, size_t end){
+            for(size_t i = begin; i < end; ++i) sites[i] = gpu_sites[i];
+        });
+    }
+    if(gpu_sites) glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glDeleteBuffers(BUFFER_COUNT, buffers);
+    glUseProgram(0);
+    return ok;
+}
+
+/* Writable shared mapping of [offset, offset + size) of an output file.
+ * With create set, the file is truncated and preallocated at file_size
+ * first, so the pages written through the mapping go out as one
+ * sequential file without growing it page by page.
+ */
+class output_mapping
+{
+public:
+    output_mapping(
+        const std::string& path,
+        bool create,
+        size_t file_size,
+        size_t offset,
+        size_t size
+    ): path(path), data(MAP_FAILED), map_size(0)
+    {
+        fd = open(
+            path.c_str(), create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR, 0644
+        );
+        if(fd < 0) throw std::runtime_error("Unable to write " + path);
+
+        // Filesystems without fallocate() still get a sparse file
+        if(
+            create &&
+            fallocate(fd, 0, 0, file_size) != 0 &&
+            ftruncate(fd, file_size) != 0
+        ){
+            close(fd);
+            throw std::runtime_error("Unable to write " + path);
+        }
+
+        size_t page_size = sysconf(_SC_PAGE_SIZE);
+        map_offset = offset / page_size * page_size;
+        map_size = size + (offset - map_offset);
+        data = mmap(
+            nullptr, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+            map_offset
+        );
+        if(data == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Unable to map " + path);
+        }
+        madvise(data, map_size, MADV_SEQUENTIAL);
+        begin = (uint8_t*)data + (offset - map_offset);
+    }
+    output_mapping(const output_mapping& other) = delete;
+
+    ~output_mapping()
+    {
+        munmap(data, map_size);
+        close(fd);
+    }
+
+    uint8_t* get() const { return begin; }
+
+    void write_header(const std::string& header)
+    {
+        if(
+            pwrite(fd, header.data(), header.size(), 0) !=
+            (ssize_t)header.size()
+        ) throw std::runtime_error("Unable to write " + path);
+    }
+
+private:
+    std::string path;
+    int fd;
+    void* data;
+    size_t map_offset;
+    size_t map_size;
+    uint8_t* begin;
+};
+
+void volume::write_layers(
+    const std::string& path_prefix,
+    unsigned axis,
+    bool single_file,
+    png_mode mode,
+    png_stats& stats,
+    zip_writer* archive
+){
+    glm::uvec2 size = get_size(axis);
+    size_t layer_size = (size_t)size.x * size.y * 4;
+    auto start = std::chrono::steady_clock::now();
+    // Time spent writing files isn't encoding
+    std::chrono::steady_clock::duration write_time(0);
+
+    unsigned batch_layers = get_batch_layers(axis);
+    if(single_file)
+    {
+        // PNG sizes are limited to 31 bits
+        size_t image_height = (size_t)size.y * dim[axis];
+        if(image_height > INT_MAX) throw std::runtime_error(
+            "The volume is too large for single-file output"
+        );
+
+        // Each layer is compressed into a strip of the image on its own, so
+        // only the layers of one batch are held at a time.
+        png_writer writer(path_prefix + ".png", size.x, image_height);
+        std::vector<png_strip> strips(batch_layers);
+        for_each_batch(axis, [&](unsigned begin, unsigned end){
+            pool.parallel_for(end - begin, [&](size_t first, size_t last){
+                std::vector<uint8_t> rgba(layer_size);
+                for(size_t i = first; i < last; ++i)
+                {
+                    convert_layer(begin + i, axis, rgba.data());
+                    encode_png_strip(
+                        rgba.data(), size.x, size.y, mode, strips[i]
+                    );
+                }
+            });
+
+            auto write_start = std::chrono::steady_clock::now();
+            for(unsigned i = 0; i < end - begin; ++i)
+            {
+                writer.write(strips[i]);
+                stats.encoded_bytes += strips[i].data.size();
+            }
+            write_time += std::chrono::steady_clock::now() - write_start;
+        });
+        writer.finish();
+    }
+    else
+    {
+        // Slabs are named by their position in the full volume, so that the
+        // files written by each slab line up with a non-streamed run. Files
+        // in an archive are named like the files would be, without the
+        // directory.
+        unsigned layer_offset = axis == 2 ? z_offset : 0;
+        unsigned layer_str_width = num_len(full_dim[axis], 10);
+        std::string name_prefix = path_prefix;
+        if(archive)
+            name_prefix = name_prefix.substr(name_prefix.rfind('/') + 1);
+
+        // Separate files are handed to an I/O queue, which writes them
+        // while the next batch is encoded. Up to a batch of raw layers may
+        // wait in it.
+        std::unique_ptr<io_queue> io;
+        if(!archive) io.reset(new io_queue(layer_size * batch_layers));
+
+        std::vector<std::vector<uint8_t>> pngs(batch_layers);
+        std::vector<uint32_t> crcs(batch_layers);
+        for_each_batch(axis, [&](unsigned begin, unsigned end){
+            pool.parallel_for(end - begin, [&](size_t first, size_t last){
+                std::vector<uint8_t> rgba(layer_size);
+                for(size_t i = first; i < last; ++i)
+                {
+                    convert_layer(begin + i, axis, rgba.data());
+                    pngs[i].clear();
+                    encode_png(rgba.data(), size.x, size.y, mode, pngs[i]);
+                    if(archive) crcs[i] = crc32(pngs[i].data(), pngs[i].size());
+                }
+            });
+
+            // Files in an archive are written in order. Separate files may
+            // complete in any order, but all are complete once this returns.
+            for(unsigned layer = begin; layer < end; ++layer)
+            {
+                std::stringstream path;
+                path << name_prefix
+                     << std::setw(layer_str_width) << std::setfill('0')
+                     << layer_offset + layer
+                     << ".png";
+                auto write_start = std::chrono::steady_clock::now();
+                stats.encoded_bytes += pngs[layer - begin].size();
+                if(archive) archive->add(
+                    path.str(), pngs[layer - begin], crcs[layer - begin]
+                );
+                else io->write(path.str(), std::move(pngs[layer - begin]));
+                write_time += std::chrono::steady_clock::now() - write_start;
+            }
+        });
+
+        if(io)
+        {
+            auto write_start = std::chrono::steady_clock::now();
+            io->finish();
+            write_time += std::chrono::steady_clock::now() - write_start;
+        }
+    }
+
+    stats.raw_bytes += layer_size * dim[axis];
+    stats.seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start - write_time
+    ).count();
+}
+
+void volume::write_raw(
+    const std::string& path,
+    bool nrrd,
+    bool alpha_only,
+    png_stats& stats
+){
+    auto start = std::chrono::steady_clock::now();
+    unsigned channels = alpha_only ? 1 : 4;
+    std::string header;
+    if(nrrd)
+    {
+        std::stringstream h;
+        h << "NRRD0004\n"
+          << "type: uint8\n"
+          << "dimension: " << (alpha_only ? 3 : 4) << "\n"
+          << "sizes:" << (alpha_only ? "" : " 4") << " "
+          << full_dim.x << " " << full_dim.y << " " << full_dim.z << "\n"
+          << "kinds:" << (alpha_only ? "" : " RGBA-color")
+          << " domain domain domain\n"
+          << "encoding: raw\n\n";
+        header = h.str();
+    }
+
+    // Each slab maps its own part of the file, which the first one creates
+    // at its full size.
+    size_t layer_size = (size_t)dim.x * dim.y * channels;
+    output_mapping out(
+        path, z_offset == 0,
+        header.size() + checked_product(layer_size, full_dim.z),
+        header.size() + layer_size * z_offset,
+        layer_size * dim.z
+    );
+    if(z_offset == 0) out.write_header(header);
+
+    // Layers are converted straight into the file
+    for_each_batch(2, [&](unsigned begin, unsigned end){
+        pool.parallel_for(end - begin, [&](size_t first, size_t last){
+            std::vector<uint8_t> rgba;
+            if(alpha_only) rgba.resize((size_t)dim.x * dim.y * 4);
+            for(size_t i = first; i < last; ++i)
+            {
+                uint8_t* dst = out.get() + (begin + i) * layer_size;
+                if(!alpha_only)
+                {
+                    convert_layer(begin + i, 2, dst);
+                    continue;
+                }
+                convert_layer(begin + i, 2, rgba.data());
+                for(size_t j = 0; j < layer_size; ++j)
+                    dst[j] = rgba[j*4+3];
+            }
+        });
+    });
+
+    stats.raw_bytes += layer_size * dim.z;
+    stats.encoded_bytes += layer_size * dim.z;
+    stats.seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start
+    ).count();
+}
+
+void volume::write_vox(const std::string& path, png_stats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Colors are counted by one quantizer per thread
+    unsigned slots = pool.get_thread_count();
+    std::vector<color_quantizer> quantizers(slots);
+    for_each_batch(2, [&](unsigned begin, unsigned end){
+        pool.parallel_for(slots, [&](size_t first, size_t last){
+            uint8_t rgba[4];
+            for(size_t slot = first; slot < last; ++slot)
+            for(unsigned z = begin + slot; z < end; z += slots)
+            for(unsigned y = 0; y < dim.y; ++y)
+            {
+                occupancy.for_each_run(y, z, [&](unsigned xb, unsigned xe){
+                    for(unsigned x = xb; x < xe; ++x)
+                    {
+                        operator[](glm::uvec3(x, y, z)).get_color(rgba);
+                        quantizers[slot].add(rgba);
+                    }
+                });
+            }
+        });
+    });
+    for(unsigned slot = 1; slot < slots; ++slot)
+        quantizers[0].merge(quantizers[slot]);
+    color_quantizer& quantizer = quantizers[0];
+    quantizer.build(VOX_PALETTE_SIZE, pool);
+
+    // Layers run from the top of the model down and rows from its back to
+    // its front, while .vox is z-up. The volume is rotated 180 degrees
+    // around the x-axis, so that it's upright without being mirrored, and
+    // all model positions are in the rotated coordinates.
+    auto to_vox = [&](unsigned y, unsigned z){
+        return glm::uvec2(dim.y - 1 - y, dim.z - 1 - z);
+    };
+
+    // Volumes larger than a model are split into a grid of models
+    glm::uvec3 grid = (dim + glm::uvec3(VOX_MODEL_SIZE - 1)) /
+        glm::uvec3(VOX_MODEL_SIZE);
+    size_t columns = (size_t)grid.x * grid.y;
+    std::vector<vox_model> models(columns * grid.z);
+    for(size_t i = 0; i < models.size(); ++i)
+    {
+        glm::uvec3 cell(i % grid.x, i / grid.x % grid.y, i / columns);
+        models[i].offset = cell * glm::uvec3(VOX_MODEL_SIZE);
+        models[i].size = glm::min(
+            dim - models[i].offset, glm::uvec3(VOX_MODEL_SIZE)
+        );
+    }
+
+    // Each layer gathers its voxels per column of models on its own, and
+    // they are appended to the models in order.
+    std::vector<std::vector<uint8_t>> layer_voxels(
+        get_batch_layers(2) * columns
+    );
+    for_each_batch(2, [&](unsigned begin, unsigned end){
+        pool.parallel_for(end - begin, [&](size_t first, size_t last){
+            uint8_t rgba[4];
+            for(size_t i = first; i < last; ++i)
+            {
+                std::vector<uint8_t>* out = &layer_voxels[i * columns];
+                for(size_t c = 0; c < columns; ++c) out[c].clear();
+
+                unsigned z = begin + i;
+                for(unsigned y = 0; y < dim.y; ++y)
+                {
+                    glm::uvec2 p = to_vox(y, z);
+                    std::vector<uint8_t>* row =
+                        out + p.x / VOX_MODEL_SIZE * grid.x;
+                    occupancy.for_each_run(y, z, [&](unsigned xb, unsigned xe){
+                        for(unsigned x = xb; x < xe; ++x)
+                        {
+                            operator[](glm::uvec3(x, y, z)).get_color(rgba);
+                            std::vector<uint8_t>& v = row[x / VOX_MODEL_SIZE];
+                            v.push_back(x % VOX_MODEL_SIZE);
+                            v.push_back(p.x % VOX_MODEL_SIZE);
+                            v.push_back(p.y % VOX_MODEL_SIZE);
+                            v.push_back(quantizer.map(rgba) + 1);
+                        }
+                    });
+                }
+            }
+        });
+
+        for(unsigned z = begin; z < end; ++z)
+        {
+            vox_model* row =
+                &models[to_vox(0, z).y / VOX_MODEL_SIZE * columns];
+            std::vector<uint8_t>* out = &layer_voxels[(z - begin) * columns];
+            for(size_t c = 0; c < columns; ++c)
+            {
+                row[c].voxels.insert(
+                    row[c].voxels.end(), out[c].begin(), out[c].end()
+                );
+            }
+        }
+    });
+
+    // Only models with voxels are written, but an empty file still needs one
+    std::vector<vox_model> occupied;
+    for(vox_model& m: models)
+        if(!m.voxels.empty()) occupied.push_back(std::move(m));
+    if(occupied.empty()) occupied.push_back(std::move(models[0]));
+
+    stats.raw_bytes += (size_t)dim.x * dim.y * dim.z * 4;
+    stats.encoded_bytes += ::write_vox(path, occupied, quantizer.get_palette());
+    stats.seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start
+    ).count();
+}
+
+void volume::write_ktx2(const std::string& path, png_stats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    ktx2_layout layout = get_ktx2_layout(dim);
+    output_mapping out(path, true, layout.file_size, 0, layout.file_size);
+    memcpy(out.get(), layout.header.data(), layout.header.size());
+
+    // The full-size level is converted straight into the file, and each
+    // smaller level is filtered from the previous one in place.
+    size_t layer_size = (size_t)dim.x * dim.y * 4;
+    uint8_t* base = out.get() + layout.level_offsets[0];
+    for_each_batch(2, [&](unsigned begin, unsigned end){
+        pool.parallel_for(end - begin, [&](size_t first, size_t last){
+            for(size_t i = first; i < last; ++i)
+                convert_layer(begin + i, 2, base + (begin + i) * layer_size);
+        });
+    });
+    for(size_t level = 1; level < layout.level_dims.size(); ++level)
+    {
+        downsample_rgba(
+            out.get() + layout.level_offsets[level - 1],
+            layout.level_dims[level - 1],
+            out.get() + layout.level_offsets[level],
+            layout.level_dims[level],
+            pool
+        );
+    }
+
+    stats.raw_bytes += layer_size * dim.z;
+    stats.encoded_bytes += layout.file_size;
+    stats.seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start
+    ).count();
+}
+
+void volume::write_tree(const std::string& path, png_stats& stats)
+{
+    // Leaf rows are bytes of occupancy words, and batches are whole leaves
+    static_assert(TREE_LEAF_SIZE == 8, "Leaf rows must be bytes");
+    static_assert(BRICK_SIZE % TREE_LEAF_SIZE == 0, "Bricks must be leaves");
+
+    auto start = std::chrono::steady_clock::now();
+    glm::uvec3 node_dim = get_lower_node_dim(dim);
+    glm::uvec3 leaf_dim = (dim + glm::uvec3(TREE_LEAF_SIZE - 1)) /
+        glm::uvec3(TREE_LEAF_SIZE);
+    std::vector<tree_node> nodes((size_t)node_dim.x * node_dim.y * node_dim.z);
+
+    // Each task builds the leaves of one row of leaves along x, with a
+    // buffer for each lower node it crosses. The rows are appended to their
+    // nodes in order afterwards, which keeps the leaves in child order.
+    struct leaf_row
+    {
+        std::vector<uint8_t> leaves;
+        std::vector<unsigned> children;
+        size_t voxel_count;
+    };
+    size_t batch_rows =
+        (size_t)get_batch_layers(2) / TREE_LEAF_SIZE * leaf_dim.y;
+    std::vector<leaf_row> rows(batch_rows * node_dim.x);
+
+    for_each_batch(2, [&](unsigned begin, unsigned end){
+        unsigned lz_begin = begin / TREE_LEAF_SIZE;
+        unsigned lz_end = (end + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE;
+        size_t row_count = (size_t)(lz_end - lz_begin) * leaf_dim.y;
+        pool.parallel_for(row_count, [&](size_t first, size_t last){
+            uint8_t mask[TREE_LEAF_MASK_BYTES];
+            for(size_t r = first; r < last; ++r)
+            {
+                unsigned ly = r % leaf_dim.y;
+                unsigned lz = lz_begin + r / leaf_dim.y;
+                leaf_row* out = &rows[r * node_dim.x];
+                for(unsigned nx = 0; nx < node_dim.x; ++nx)
+                {
+                    out[nx].leaves.clear();
+                    out[nx].children.clear();
+                    out[nx].voxel_count = 0;
+                }
+
+                for(unsigned lx = 0; lx < leaf_dim.x; ++lx)
+                {
+                    unsigned x0 = lx * TREE_LEAF_SIZE;
+                    bool empty = true;
+                    for(unsigned i = 0; i < TREE_LEAF_MASK_BYTES; ++i)
+                    {
+                        unsigned y = ly * TREE_LEAF_SIZE + i % TREE_LEAF_SIZE;
+                        unsigned z = lz * TREE_LEAF_SIZE + i / TREE_LEAF_SIZE;
+                        mask[i] = y < dim.y && z < dim.z ?
+                            occupancy.get_row(y, z)[x0 / 64] >> (x0 % 64) : 0;
+                        if(mask[i]) empty = false;
+                    }
+                    if(empty) continue;
+
+                    leaf_row& row = out[lx / TREE_LOWER_SIZE];
+                    row.children.push_back(
+                        lx % TREE_LOWER_SIZE + (
+                            ly % TREE_LOWER_SIZE +
+                            lz % TREE_LOWER_SIZE * TREE_LOWER_SIZE
+                        ) * TREE_LOWER_SIZE
+                    );
+                    row.leaves.insert(
+                        row.leaves.end(), mask, mask + TREE_LEAF_MASK_BYTES
+                    );
+                    for(unsigned i = 0; i < TREE_LEAF_MASK_BYTES; ++i)
+                    {
+                        glm::uvec3 pos(
+                            0,
+                            ly * TREE_LEAF_SIZE + i % TREE_LEAF_SIZE,
+                            lz * TREE_LEAF_SIZE + i / TREE_LEAF_SIZE
+                        );
+                        for(unsigned bits = mask[i]; bits; bits &= bits - 1)
+                        {
+                            pos.x = x0 + __builtin_ctz(bits);
+                            size_t at = row.leaves.size();
+                            row.leaves.resize(at + 4);
+                            operator[](pos).get_color(&row.leaves[at]);
+                            row.voxel_count++;
+                        }
+                    }
+                }
+            }
+        });
+
+        for(size_t r = 0; r < row_count; ++r)
+        {
+            unsigned ly = r % leaf_dim.y;
+            unsigned lz = lz_begin + r / leaf_dim.y;
+            tree_node* node_row = &nodes[(
+                ly / TREE_LOWER_SIZE +
+                (size_t)lz / TREE_LOWER_SIZE * node_dim.y
+            ) * node_dim.x];
+            for(unsigned nx = 0; nx < node_dim.x; ++nx)
+            {
+                const leaf_row& row = rows[r * node_dim.x + nx];
+                tree_node& node = node_row[nx];
+                node.leaves.insert(
+                    node.leaves.end(), row.leaves.begin(), row.leaves.end()
+                );
+                for(unsigned child: row.children)
+                    node.child_mask[child / 64] |= (uint64_t)1 << (child % 64);
+                node.leaf_count += row.children.size();
+                node.voxel_count += row.voxel_count;
+            }
+        }
+    });
+
+    stats.raw_bytes += (size_t)dim.x * dim.y * dim.z * 4;
+    stats.encoded_bytes += write_sparse_tree(path, dim, nodes);
+    stats.seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start
+    ).count();
+}
+
+// Header and index of a packed chunk file, padded to where the chunks start
+static std::vector<uint8_t> get_chunk_header(
+    glm::uvec3 dim,
+    unsigned chunk_size,
+    const std::vector<glm::uvec3>& chunks,
+    size_t chunk_bytes
+){
+    std::vector<uint8_t> header;
+    auto put = [&](uint64_t value, unsigned bytes){
+        for(unsigned i = 0; i < bytes; ++i) header.push_back(value >> (i*8));
+    };
+
+    // Chunk data starts on a page boundary, so that it can be mapped
+    size_t index_end = 40 + chunks.size() * 24;
+    size_t data_offset = (index_end + 4095) / 4096 * 4096;
+    header.insert(header.end(), {'V', 'X', 'C', 'H'});
+    put(1, 4);
+    for(unsigned i = 0; i < 3; ++i) put(dim[i], 4);
+    put(chunk_size, 4);
+    put(chunks.size(), 8);
+    put(data_offset, 8);
+    for(size_t i = 0; i < chunks.size(); ++i)
+    {
+        for(unsigned j = 0; j < 3; ++j) put(chunks[i][j], 4);
+        put(0, 4);
+        put(data_offset + i * chunk_bytes, 8);
+    }
+    header.resize(data_offset, 0);
+    return header;
+}
+
+void volume::write_chunks(
+    const std::string& path_prefix,
+    unsigned chunk_size,
+    bool packed,
+    png_stats& stats
+){
+    auto start = std::chrono::steady_clock::now();
+    glm::uvec3 grid = (dim + glm::uvec3(chunk_size - 1)) /
+        glm::uvec3(chunk_size);
+    size_t chunk_bytes = checked_product(
+        checked_product(chunk_size, chunk_size, chunk_size), 4
+    );
+
+    // Empty chunks are found from the occupancy alone and skipped
+    size_t grid_size = (size_t)grid.x * grid.y * grid.z;
+    std::vector<uint8_t> occupied(grid_size);
+    auto get_origin = [&](size_t i){
+        return glm::uvec3(
+            i % grid.x, i / grid.x % grid.y, i / grid.x / grid.y
+        ) * chunk_size;
+    };
+    pool.parallel_for(grid_size, [&](size_t first, size_t last){
+        for(size_t i = first; i < last; ++i)
+        {
+            glm::uvec3 origin = get_origin(i);
+            glm::uvec3 end = glm::min(origin + glm::uvec3(chunk_size), dim);
+            occupied[i] = !occupancy.box_empty(origin, end);
+        }
+    });
+    std::vector<glm::uvec3> chunks;
+    for(size_t i = 0; i < grid_size; ++i)
+        if(occupied[i]) chunks.push_back(get_origin(i) / chunk_size);
+
+    // A packed file has a known layout, so the chunks are converted
+    // straight into their places in a mapping of it.
+    std::unique_ptr<output_mapping> out;
+    size_t data_offset = 0;
+    if(packed)
+    {
+        std::vector<uint8_t> header = get_chunk_header(
+            dim, chunk_size, chunks, chunk_bytes
+        );
+        data_offset = header.size();
+        size_t file_size = data_offset + chunks.size() * chunk_bytes;
+        out.reset(new output_mapping(
+            path_prefix + ".vxc", true, file_size, 0, file_size
+        ));
+        memcpy(out->get(), header.data(), header.size());
+        stats.encoded_bytes += data_offset;
+    }
+
+    auto convert_chunk = [&](glm::uvec3 chunk, uint8_t* dst){
+        glm::uvec3 origin = chunk * chunk_size;
+        glm::uvec3 end = glm::min(origin + glm::uvec3(chunk_size), dim);
+        for(unsigned z = origin.z; z < end.z; ++z)
+        for(unsigned y = origin.y; y < end.y; ++y)
+        {
+            uint8_t* row = dst + (
+                (size_t)(z - origin.z) * chunk_size + (y - origin.y)
+            ) * chunk_size * 4;
+            for(unsigned x = origin.x; x < end.x; ++x)
+            {
+                glm::uvec3 pos(x, y, z);
+                if(occupancy.get(pos))
+                    operator[](pos).get_color(row + (x - origin.x) * 4);
+            }
+        }
+    };
+
+    // Chunks are written a layer of chunks at a time, so that only its
+    // bricks need to be decompressed. Separate files are queued by the
+    // threads that convert them, and written while the next ones are
+    // converted.
+    std::unique_ptr<io_queue> io;
+    if(!packed)
+        io.reset(new io_queue(chunk_bytes * pool.get_thread_count() * 2));
+    size_t layer_begin = 0;
+    for(unsigned cz = 0; cz < grid.z; ++cz)
+    {
+        size_t layer_end = layer_begin;
+        while(layer_end < chunks.size() && chunks[layer_end].z == cz)
+            layer_end++;
+        if(layer_end == layer_begin) continue;
+
+        unsigned z_begin = cz * chunk_size;
+        unsigned z_end = glm::min(z_begin + chunk_size, dim.z);
+        decompress(z_begin, z_end, false);
+        pool.parallel_for(
+            layer_end - layer_begin,
+            [&](size_t first, size_t last){
+                for(size_t i = layer_begin + first; i < layer_begin + last; ++i)
+                {
+                    if(packed)
+                    {
+                        convert_chunk(
+                            chunks[i],
+                            out->get() + data_offset + i * chunk_bytes
+                        );
+                        continue;
+                    }
+
+                    std::vector<uint8_t> buf(chunk_bytes, 0);
+                    convert_chunk(chunks[i], buf.data());
+                    std::string path = path_prefix + "_" +
+                        std::to_string(chunks[i].x) + "_" +
+                        std::to_string(chunks[i].y) + "_" +
+                        std::to_string(chunks[i].z) + ".raw";
+                    io->write(path, std::move(buf));
+                }
+            }
+        );
+        compress(z_begin, z_end);
+        layer_begin = layer_end;
+    }
+    if(io) io->finish();
+
+    stats.raw_bytes += (size_t)dim.x * dim.y * dim.z * 4;
+    stats.encoded_bytes += chunks.size() * chunk_bytes;
+    stats.seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start
+    ).count();
+}
+
+unsigned volume::get_batch_layers(unsigned axis) const
+{
+    // Each batch is a whole number of brick layers along z, so that only its
+    // bricks need to be decompressed, and its size bounds the memory used by
+    // layers in flight.
+    unsigned batch_layers = pool.get_thread_count() * 2;
+    if(axis == 2)
+    {
+        batch_layers =
+            (batch_layers + BRICK_SIZE - 1) / BRICK_SIZE * BRICK_SIZE;
+    }
+    return batch_layers;
+}
+
+void volume::for_each_batch(
+    unsigned axis,
+    const std::function<void(unsigned begin, unsigned end)>& f
+){
+    unsigned batch_layers = get_batch_layers(axis);
+    if(axis != 2) decompress(false);
+    for(unsigned begin = 0; begin < dim[axis]; begin += batch_layers)
+    {
+        unsigned end = std::min(begin + batch_layers, dim[axis]);
+        if(axis == 2) decompress(begin, end, false);
+        f(begin, end);
+        if(axis == 2) compress(begin, end);
+    }
+    compress();
+}
+
+void volume::convert_layer(unsigned layer, unsigned axis, uint8_t* rgba)
+{
+    glm::uvec2 size = get_size(axis);
+    for(unsigned y = 0; y < size.y; ++y)
+    {
+        uint8_t* row = rgba + (size_t)y * size.x * 4;
+        if(axis != 2)
+        {
+            for(unsigned x = 0; x < size.x; ++x)
+            {
+                glm::uvec3 pos = get_layer_pos(layer, axis, glm::uvec2(x, y));
+                if(occupancy.get(pos)) operator[](pos).get_color(row + x*4);
+                else memset(row + x*4, 0, 4);
+            }
+            continue;
+        }
+
+        // z-layer rows are occupancy rows, so empty runs are cleared as a
+        // whole without looking at the voxels.
+        unsigned empty_begin = 0;
+        occupancy.for_each_run(y, layer, [&](unsigned xb, unsigned xe){
+            memset(row + empty_begin*4, 0, (size_t)(xb - empty_begin) * 4);
+            for(unsigned x = xb; x < xe; ++x)
+                operator[](glm::uvec3(x, y, layer)).get_color(row + x*4);
+            empty_begin = xe;
+        });
+        memset(row + empty_begin*4, 0, (size_t)(size.x - empty_begin) * 4);
+    }
+}
+
+void volume::get_brick_range(
+    unsigned z_begin, unsigned z_end, size_t& first, size_t& last
+) const
+{
+    size_t slice_bricks = (size_t)brick_dim.x * brick_dim.y;
+    first = z_begin / BRICK_SIZE * slice_bricks;
+    last = glm::min(
+        (z_end + BRICK_SIZE - 1) / BRICK_SIZE * slice_bricks, bricks.size()
+    );
+}
+
+voxel* volume::get_brick_voxels(size_t brick_index) const
+{
+    return voxels + brick_index * BRICK_VOXELS;
+}
+
+voxel volume::read_voxel(glm::uvec3 pos, brick_cache& cache) const
+{
+    size_t i = index(pos);
+    size_t brick_index = i / BRICK_VOXELS;
+    const brick& b = bricks[brick_index];
+    if(b.state != BRICK_PACKED) return voxels[i];
+    if(b.packed.empty()) return voxel{0};
+
+    brick_cache::entry& e = cache.entries[brick_index % brick_cache::size];
+    if(e.brick_index != brick_index)
+    {
+        e.voxels.resize(BRICK_VOXELS);
+        decode_brick(b.packed, sizeof(voxel), e.voxels.data());
+        e.brick_index = brick_index;
+    }
+    return e.voxels[i % BRICK_VOXELS];
+}
+
+void volume::init_buffers()
+{
+    size_t area = max_area(dim);
+    layer_buffer = new uint8_t[area*4];
+    stencil_buffer = new uint8_t[area];
+    priority_buffer = new uint8_t[area];
+    memset(priority_buffer, 0, sizeof(*priority_buffer)*area);
+}
@@ -0,0 +1,445 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_VOLUME_HH
+#define VOXELSLICER_VOLUME_HH
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "storage.hh"
+#include "thread_pool.hh"
+#include "brick.hh"
+#include "bitmask.hh"
+#include "png.hh"
+
+enum fill_mode
+{
+    FILL_NONE = 0,
+    FILL_FLATPLUS,
+    FILL_VOLUMEPLUS,
+    FILL_FLATY,
+    FILL_FLATX,
+    FILL_FLATZ
+};
+
+enum sdf_format
+{
+    SDF_NONE = 0,
+    // 32-bit floats in model units
+    SDF_FLOAT,
+    // 16-bit integers in 1/256ths of a voxel, offset by 32768
+    SDF_U16
+};
+
+enum output_format
+{
+    OUTPUT_PNG = 0,
+    // 8-bit RGBA without a header
+    OUTPUT_RAW,
+    // 8-bit alpha without a header
+    OUTPUT_RAW_ALPHA,
+    OUTPUT_NRRD,
+    OUTPUT_NRRD_ALPHA,
+    // MagicaVoxel model
+    OUTPUT_VOX,
+    // 3D texture with mipmaps
+    OUTPUT_KTX2,
+    // Sparse tree of occupied voxels
+    OUTPUT_TREE,
+    // Fixed-size chunks, one file each or packed into one
+    OUTPUT_CHUNKS,
+    OUTPUT_CHUNKS_PACKED,
+    // PNG images in one uncompressed zip archive
+    OUTPUT_ZIP
+};
+
+/* Voxels are packed in 64 bits so that samples can be merged into them
+ * atomically from several threads. Each color channel holds the sum of its
+ * samples in 11 bits, followed by a 4-bit sample count and an 8-bit priority.
+ * Only the samples with the lowest priority value are kept, so the result
+ * doesn't depend on the order in which samples are merged. All-zero bits are
+ * an empty voxel, since the voxels live in zero-initialized storage without
+ * being constructed.
+ */
+struct voxel
+{
+    uint64_t bits;
+
+    // 11 bits per channel fit this many samples of 255
+    static const unsigned max_count = 8;
+
+    bool empty() const { return get_count() == 0; }
+    unsigned get_count() const { return (bits >> 44) & 0xF; }
+    unsigned get_priority() const { return (bits >> 48) & 0xFF; }
+
+    // Average of the samples
+    void get_color(uint8_t* rgba) const
+    {
+        unsigned count = get_count();
+        for(unsigned i = 0; i < 4; ++i)
+            rgba[i] = count ? ((bits >> (i*11)) & 0x7FF) / count : 0;
+    }
+
+    glm::vec4 get_color() const
+    {
+        uint8_t rgba[4];
+        get_color(rgba);
+        return glm::vec4(rgba[0], rgba[1], rgba[2], rgba[3]) / 255.0f;
+    }
+
+    // Replaces the voxel with a single sample of the given color.
+    void set_color(glm::vec4 color)
+    {
+        bits = (uint64_t)1 << 44;
+        for(unsigned i = 0; i < 4; ++i)
+            bits |= (uint64_t)glm::round(
+                glm::clamp(color[i], 0.0f, 1.0f) * 255.0f
+            ) << (i*11);
+    }
+
+    // Atomically merges a sample into the voxel.
+    void merge(const uint8_t* rgba, unsigned priority)
+    {
+        uint64_t old_bits = __atomic_load_n(&bits, __ATOMIC_RELAXED);
+        uint64_t new_bits;
+        do
+        {
+            voxel old = {old_bits};
+            uint64_t sample = (uint64_t)priority << 48 | (uint64_t)1 << 44;
+            for(unsigned i = 0; i < 4; ++i)
+                sample |= (uint64_t)rgba[i] << (i*11);
+
+            if(old.empty() || priority < old.get_priority())
+                new_bits = sample;
+            else if(
+                priority == old.get_priority() &&
+                old.get_count() < max_count
+            ) new_bits = old_bits + (sample & (((uint64_t)1 << 48) - 1));
+            else return;
+        }
+        while(!__atomic_compare_exchange_n(
+            &bits, &old_bits, new_bits, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED
+        ));
+    }
+};
+
+class model;
+class zip_writer;
+class volume
+{
+public:
+    /* A volume may only cover the z-slab [z_begin, z_end) of the full
+     * volume, in which case only that slab is kept in memory. dim is always
+     * the size of the full volume. Layer indices given to read_gl_layer() are
+     * local to the slab, while write_layers() numbers the layers according to
+     * their position in the full volume. Rendered layers are merged into the
+     * volume by the threads of the given pool.
+     */
+    volume(
+        glm::uvec3 dim,
+        unsigned z_begin,
+        unsigned z_end,
+        thread_pool& pool
+    );
+    volume(const volume& other) = delete;
+    ~volume();
+
+    /* Voxels are stored in bricks of BRICK_SIZE^3, so neighboring voxels
+     * aren't necessarily next to each other in memory. Use index() instead of
+     * computing offsets by hand.
+     */
+    voxel& operator[](glm::uvec3 pos) const;
+    size_t index(glm::uvec3 pos) const;
+    size_t get_index_count() const;
+
+    /* Occupied voxels, maintained along with the voxels. Use this instead of
+     * the voxels when only occupancy is needed; it's 64 times smaller and
+     * doesn't need decompressing.
+     */
+    const bitmask& get_occupancy() const;
+
+    glm::uvec3 get_dim() const;
+    glm::uvec3 get_full_dim() const;
+    unsigned get_z_offset() const;
+
+    glm::uvec2 get_size(unsigned axis) const;
+
+    glm::uvec3 get_layer_pos(
+        unsigned layer_index, unsigned axis, glm::uvec2 p
+    ) const;
+
+    void read_gl_priority(unsigned axis);
+    /* Reads the rendered layer and queues it to be merged. Only the priority
+     * read last by read_gl_priority() is used for the layer. This blocks if
+     * too many layers are already waiting to be merged.
+     */
+    void read_gl_layer(
+        unsigned layer_index,
+        unsigned axis,
+        bool force_overwrite
+    );
+
+    /* Merges a layer of RGBA colors into the volume. Pixels with a zero
+     * stencil are skipped. Lower priority values take precedence, and
+     * force_overwrite takes precedence over all of them. May be called from
+     * any number of threads at once, also for overlapping layers; the result
+     * is the same in any order.
+     */
+    void merge_layer(
+        unsigned layer_index,
+        unsigned axis,
+        const uint8_t* color,
+        const uint8_t* stencil,
+        const uint8_t* priority,
+        bool force_overwrite
+    );
+
+    /* Reads the stencil of a rendered z-layer as inside voxels, for fill.
+     * Nonzero stencil values mark voxels inside the model.
+     */
+    void read_gl_inside(unsigned layer_index);
+
+    // Waits until all layers read so far have been merged.
+    void finish();
+
+    /* Finished bricks can be compressed to save memory. Rendering merges
+     * layers along every axis into every brick, so the whole volume is
+     * dense until finish(); compressing right after that bounds the memory
+     * used by fill(), write_sdf() and the queued slabs of streamed output.
+     * Compressed bricks must be decompressed before their voxels are
+     * accessed. If modify is
+     * false, the compressed copy is kept, so compressing the bricks again
+     * after reading them is free. Otherwise, the voxels may be changed and the
+     * bricks are compressed again from scratch. Both take the range of layers
+     * [z_begin, z_end) whose bricks are affected.
+     */
+    void compress(unsigned z_begin, unsigned z_end);
+    void compress();
+    void decompress(unsigned z_begin, unsigned z_end, bool modify);
+    void decompress(bool modify);
+
+    /* Fills the empty voxels enclosed by surfaces with the colors of nearby
+     * voxels. Enclosed regions that are inside an even number of nested
+     * surfaces are hollow chambers, which are left empty if keep_cavities is
+     * set. With gpu set, the fill runs on compute shaders in the current GL
+     * context if it supports them and cavities aren't kept. If z-layers were
+     * read with read_gl_inside(), they decide which voxels are enclosed.
+     * A nonzero shell_voxels only fills the voxels within that many voxels
+     * of their nearest occupied voxel, leaving a hollow shell. Distances are
+     * measured along the axes that colors spread along, so the shell is only
+     * even with FILL_VOLUMEPLUS.
+     */
+    void fill(
+        model& m,
+        fill_mode mode,
+        bool keep_cavities,
+        bool gpu,
+        unsigned shell_voxels
+    );
+
+    /* Writes the signed distance of each voxel to the nearest occupied voxel
+     * into a raw file, with the x-axis varying fastest. Distances are
+     * negative inside the model, which is decided like in fill(). Call this
+     * before fill(), or the filled voxels count as surface too.
+     */
+    void write_sdf(
+        model& m,
+        const std::string& path,
+        sdf_format format,
+        bool keep_cavities
+    );
+
+    /* Writes the layers along an axis as PNG images encoded with the given
+     * mode, and adds the bytes and time spent converting and encoding them
+     * to stats. Unless single_file is set, the images can go into an
+     * archive instead of files of their own.
+     */
+    void write_layers(
+        const std::string& path_prefix,
+        unsigned axis,
+        bool single_file,
+        png_mode mode,
+        png_stats& stats,
+        zip_writer* archive = nullptr
+    );
+
+    /* Writes the voxels as 8-bit RGBA or alpha into a single raw file, with
+     * the x-axis varying fastest, optionally after an NRRD header. Each slab
+     * of a streamed volume fills in its own part of the same file, so they
+     * must be written in order. The layers are converted straight into a
+     * mapping of the file, which is counted in stats like encoded images.
+     */
+    void write_raw(
+        const std::string& path,
+        bool nrrd,
+        bool alpha_only,
+        png_stats& stats
+    );
+
+    /* Writes the occupied voxels as a MagicaVoxel .vox file, with their
+     * colors reduced to its 255-color palette. Volumes larger than the
+     * largest .vox model are split into several models of a scene. Needs the
+     * whole volume, since the palette is shared by all voxels.
+     */
+    void write_vox(const std::string& path, png_stats& stats);
+
+    /* Writes the voxels as an 8-bit RGBA 3D texture in a KTX2 file, with a
+     * full mip chain that can be uploaded as is. Needs the whole volume.
+     */
+    void write_ktx2(const std::string& path, png_stats& stats);
+
+    /* Writes the occupied voxels as a sparse tree of 8^3 leaves in the
+     * layout of sparse_tree.hh. Leaves are built from the occupancy on all
+     * threads, so empty regions cost next to nothing. Needs the whole
+     * volume.
+     */
+    void write_tree(const std::string& path, png_stats& stats);
+
+    /* Writes the volume as cubes of chunk_size^3 8-bit RGBA voxels, with the
+     * x-axis varying fastest and the chunks at the far edges padded with
+     * empty voxels. Chunks without occupied voxels are skipped. Each chunk
+     * goes in a file of its own named by its chunk coordinates, or with
+     * packed set, all go in one file after an index of their coordinates and
+     * offsets. Chunks are converted and written on all threads. Needs the
+     * whole volume.
+     */
+    void write_chunks(
+        const std::string& path_prefix,
+        unsigned chunk_size,
+        bool packed,
+        png_stats& stats
+    );
+
+private:
+    enum brick_state
+    {
+        // Only the voxel storage is valid
+        BRICK_DENSE = 0,
+        // Only the compressed data is valid, the voxel storage is released
+        BRICK_PACKED,
+        // Both are valid and identical
+        BRICK_CACHED
+    };
+
+    struct brick
+    {
+        brick_state state = BRICK_DENSE;
+        std::vector<uint8_t> packed;
+    };
+
+    // Bricks recently decoded by read_voxel(), for one thread
+    struct brick_cache
+    {
+        static const size_t size = 8;
+        struct entry
+        {
+            size_t brick_index = SIZE_MAX;
+            std::vector<voxel> voxels;
+        };
+        entry entries[size];
+    };
+
+    // Layer read from GL, waiting to be merged
+    struct layer_job
+    {
+        unsigned layer_index;
+        unsigned axis;
+        bool force_overwrite;
+        std::vector<uint8_t> color;
+        std::vector<uint8_t> stencil;
+        std::vector<uint8_t> priority;
+    };
+
+    void init_buffers();
+    glm::uvec3 get_linear_pos(uint64_t linear) const;
+    // Size of a voxel in model units
+    glm::vec3 get_spacing(model& m) const;
+    // Marks the empty voxels that fill() would leave empty.
+    void find_outside(bitmask& outside, bool keep_cavities);
+    // Fill on compute shaders, returns false if they are unavailable.
+    bool fill_gpu(const bool axes[3], glm::vec3 spacing, double max_dist2);
+    // Marks the voxels that read_gl_inside() didn't mark as inside.
+    void mark_not_inside(bitmask& outside) const;
+    /* Colors the empty voxels that aren't outside with their nearest occupied
+     * voxels, slab by slab. Voxels further than sqrt(max_dist2) from them are
+     * left empty.
+     */
+    void fill_slabs(
+        const bool axes[3],
+        glm::vec3 spacing,
+        double max_dist2,
+        const bitmask& outside
+    );
+    bool find_sites_gpu(
+        const bool axes[3],
+        glm::vec3 spacing,
+        bitmask& outside,
+        uint64_t* sites
+    );
+    // Layers per batch in for_each_batch()
+    unsigned get_batch_layers(unsigned axis) const;
+    /* Calls f(begin, end) for consecutive batches of layers along an axis,
+     * with the bricks of each batch decompressed for reading. Along z, only
+     * the bricks of the current batch are decompressed at a time.
+     */
+    void for_each_batch(
+        unsigned axis,
+        const std::function<void(unsigned begin, unsigned end)>& f
+    );
+    // Converts a layer into 8-bit RGBA, empty voxels are transparent black.
+    void convert_layer(unsigned layer, unsigned axis, uint8_t* rgba);
+    // Range of bricks [first, last) covering the layers [z_begin, z_end)
+    void get_brick_range(
+        unsigned z_begin, unsigned z_end, size_t& first, size_t& last
+    ) const;
+    voxel* get_brick_voxels(size_t brick_index) const;
+    /* Reads a voxel without decompressing its brick, decoding compressed
+     * bricks into the cache instead. The brick states may not change while
+     * this is in use.
+     */
+    voxel read_voxel(glm::uvec3 pos, brick_cache& cache) const;
+
+    glm::uvec3 dim;
+    glm::uvec3 brick_dim;
+    storage voxel_data;
+    voxel* voxels;
+    std::vector<brick> bricks;
+    bitmask occupancy;
+    // Only allocated once read_gl_inside() is used
+    std::unique_ptr<bitmask> inside;
+    glm::uvec3 full_dim;
+    unsigned z_offset;
+
+    thread_pool& pool;
+    std::vector<std::unique_ptr<layer_job>> jobs;
+    std::vector<layer_job*> free_jobs;
+    std::mutex job_mutex;
+    std::condition_variable job_cv;
+
+    uint8_t* layer_buffer;
+    uint8_t* stencil_buffer;
+    uint8_t* priority_buffer;
+};
+
+#endif
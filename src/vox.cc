@@ -0,0 +1,314 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "vox.hh"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+#define VOX_VERSION 150
+
+color_quantizer::color_quantizer()
+: bins(1 << 15)
+{
+}
+
+void color_quantizer::merge(const color_quantizer& other)
+{
+    for(size_t key = 0; key < bins.size(); ++key)
+    {
+        const bin& o = other.bins[key];
+        if(o.count == 0) continue;
+
+        bin& b = bins[key];
+        if(b.count == 0) b.first = o.first;
+        else if(b.first != o.first) b.mixed = true;
+        b.mixed = b.mixed || o.mixed;
+        b.count += o.count;
+        for(unsigned i = 0; i < 4; ++i) b.sum[i] += o.sum[i];
+    }
+}
+
+void color_quantizer::build(unsigned max_colors, thread_pool& pool)
+{
+    std::vector<unsigned> keys;
+    bool exact = true;
+    for(unsigned key = 0; key < bins.size(); ++key)
+    {
+        if(bins[key].count == 0) continue;
+        keys.push_back(key);
+        if(bins[key].mixed) exact = false;
+    }
+
+    palette.clear();
+    lut.assign(bins.size(), 0);
+    if(exact && keys.size() <= max_colors)
+    {
+        for(unsigned key: keys)
+        {
+            lut[key] = palette.size();
+            palette.push_back(bins[key].first);
+        }
+        return;
+    }
+
+    std::vector<glm::vec4> means(bins.size());
+    for(unsigned key: keys)
+    {
+        const bin& b = bins[key];
+        for(unsigned i = 0; i < 4; ++i)
+            means[key][i] = (double)b.sum[i] / b.count;
+    }
+
+    // Boxes are ranges of keys. The box with the most voxels times its
+    // widest channel is split at its median along that channel, until there
+    // are enough boxes or none can be split.
+    struct box
+    {
+        unsigned begin, end;
+        uint64_t count;
+        unsigned channel;
+        float extent;
+    };
+    auto measure = [&](box& bx){
+        glm::vec4 lo(INFINITY), hi(-INFINITY);
+        bx.count = 0;
+        for(unsigned i = bx.begin; i < bx.end; ++i)
+        {
+            lo = glm::min(lo, means[keys[i]]);
+            hi = glm::max(hi, means[keys[i]]);
+            bx.count += bins[keys[i]].count;
+        }
+        glm::vec4 extent = hi - lo;
+        bx.channel = 0;
+        for(unsigned i = 1; i < 4; ++i)
+            if(extent[i] > extent[bx.channel]) bx.channel = i;
+        bx.extent = extent[bx.channel];
+    };
+
+    std::vector<box> boxes(1, box{0, (unsigned)keys.size(), 0, 0, 0});
+    measure(boxes[0]);
+    while(boxes.size() < max_colors)
+    {
+        int best = -1;
+        double best_error = 0;
+        for(size_t i = 0; i < boxes.size(); ++i)
+        {
+            double error = (double)boxes[i].count * boxes[i].extent;
+            if(boxes[i].end - boxes[i].begin >= 2 && error > best_error)
+            {
+                best = i;
+                best_error = error;
+            }
+        }
+        if(best < 0) break;
+
+        box lower = boxes[best];
+        unsigned channel = lower.channel;
+        std::sort(
+            keys.begin() + lower.begin, keys.begin() + lower.end,
+            [&](unsigned a, unsigned b){
+                if(means[a][channel] != means[b][channel])
+                    return means[a][channel] < means[b][channel];
+                return a < b;
+            }
+        );
+
+        uint64_t half = lower.count / 2, below = 0;
+        unsigned split = lower.begin + 1;
+        for(unsigned i = lower.begin; i < lower.end - 1; ++i)
+        {
+            below += bins[keys[i]].count;
+            split = i + 1;
+            if(below >= half) break;
+        }
+
+        box upper = lower;
+        upper.begin = split;
+        lower.end = split;
+        measure(lower);
+        measure(upper);
+        boxes[best] = lower;
+        boxes.push_back(upper);
+    }
+
+    std::vector<glm::vec4> colors;
+    for(const box& bx: boxes)
+    {
+        uint64_t sum[4] = {0, 0, 0, 0};
+        for(unsigned i = bx.begin; i < bx.end; ++i)
+            for(unsigned c = 0; c < 4; ++c) sum[c] += bins[keys[i]].sum[c];
+
+        uint8_t rgba[4];
+        for(unsigned c = 0; c < 4; ++c)
+            rgba[c] = (sum[c] + bx.count / 2) / bx.count;
+        uint32_t color;
+        memcpy(&color, rgba, sizeof(color));
+        palette.push_back(color);
+        colors.push_back(glm::vec4(rgba[0], rgba[1], rgba[2], rgba[3]));
+    }
+
+    // Each bin maps to the palette color nearest to its mean
+    pool.parallel_for(keys.size(), [&](size_t begin, size_t end){
+        for(size_t i = begin; i < end; ++i)
+        {
+            glm::vec4 mean = means[keys[i]];
+            float best_dist = INFINITY;
+            for(size_t j = 0; j < colors.size(); ++j)
+            {
+                glm::vec4 d = colors[j] - mean;
+                float dist = glm::dot(d, d);
+                if(dist < best_dist)
+                {
+                    best_dist = dist;
+                    lut[keys[i]] = j;
+                }
+            }
+        }
+    });
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for(unsigned i = 0; i < 4; ++i) out.push_back(value >> (i*8));
+}
+
+static void put_string(std::vector<uint8_t>& out, const std::string& str)
+{
+    put_u32(out, str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+static void put_chunk_header(
+    std::vector<uint8_t>& out,
+    const char* id,
+    uint32_t content_size,
+    uint32_t children_size
+){
+    out.insert(out.end(), id, id + 4);
+    put_u32(out, content_size);
+    put_u32(out, children_size);
+}
+
+// Starts a chunk whose content size is filled in by end_chunk()
+static size_t begin_chunk(std::vector<uint8_t>& out, const char* id)
+{
+    size_t start = out.size();
+    put_chunk_header(out, id, 0, 0);
+    return start;
+}
+
+static void end_chunk(std::vector<uint8_t>& out, size_t start)
+{
+    uint32_t size = out.size() - start - 12;
+    for(unsigned i = 0; i < 4; ++i) out[start + 4 + i] = size >> (i*8);
+}
+
+// Transform node with an optional translation, of a single frame
+static void put_transform(
+    std::vector<uint8_t>& out,
+    uint32_t id,
+    uint32_t child,
+    int32_t layer,
+    const std::string& translation
+){
+    size_t start = begin_chunk(out, "nTRN");
+    put_u32(out, id);
+    put_u32(out, 0);
+    put_u32(out, child);
+    put_u32(out, -1);
+    put_u32(out, layer);
+    put_u32(out, 1);
+    if(translation.empty()) put_u32(out, 0);
+    else
+    {
+        put_u32(out, 1);
+        put_string(out, "_t");
+        put_string(out, translation);
+    }
+    end_chunk(out, start);
+}
+
+size_t write_vox(
+    const std::string& path,
+    const std::vector<vox_model>& models,
+    const std::vector<uint32_t>& palette
+){
+    // The scene graph places each model under one group:
+    // transform 0 -> group 1 -> transform 2+2i -> shape 3+2i -> model i
+    std::vector<uint8_t> tail;
+    put_transform(tail, 0, 1, -1, "");
+    size_t start = begin_chunk(tail, "nGRP");
+    put_u32(tail, 1);
+    put_u32(tail, 0);
+    put_u32(tail, models.size());
+    for(size_t i = 0; i < models.size(); ++i) put_u32(tail, 2 + 2*i);
+    end_chunk(tail, start);
+
+    for(size_t i = 0; i < models.size(); ++i)
+    {
+        // Models are centered on their translation
+        glm::uvec3 center = models[i].offset + models[i].size / 2u;
+        put_transform(
+            tail, 2 + 2*i, 3 + 2*i, 0,
+            std::to_string(center.x) + " " + std::to_string(center.y) + " " +
+            std::to_string(center.z)
+        );
+        start = begin_chunk(tail, "nSHP");
+        put_u32(tail, 3 + 2*i);
+        put_u32(tail, 0);
+        put_u32(tail, 1);
+        put_u32(tail, i);
+        put_u32(tail, 0);
+        end_chunk(tail, start);
+    }
+
+    start = begin_chunk(tail, "RGBA");
+    for(unsigned i = 0; i < 256; ++i)
+        put_u32(tail, i < palette.size() ? palette[i] : 0);
+    end_chunk(tail, start);
+
+    // Model voxels are written straight from the models
+    uint64_t children_size = tail.size();
+    for(const vox_model& m: models)
+        children_size += 24 + 16 + m.voxels.size();
+    if(children_size > UINT32_MAX)
+        throw std::runtime_error("The volume is too large for a .vox file");
+
+    std::vector<uint8_t> head;
+    head.insert(head.end(), {'V', 'O', 'X', ' '});
+    put_u32(head, VOX_VERSION);
+    put_chunk_header(head, "MAIN", 0, children_size);
+
+    std::ofstream f(path, std::ios::binary);
+    f.write((const char*)head.data(), head.size());
+    for(const vox_model& m: models)
+    {
+        head.clear();
+        put_chunk_header(head, "SIZE", 12, 0);
+        for(unsigned i = 0; i < 3; ++i) put_u32(head, m.size[i]);
+        put_chunk_header(head, "XYZI", 4 + m.voxels.size(), 0);
+        put_u32(head, m.voxels.size() / 4);
+        f.write((const char*)head.data(), head.size());
+        f.write((const char*)m.voxels.data(), m.voxels.size());
+    }
+    f.write((const char*)tail.data(), tail.size());
+    if(!f) throw std::runtime_error("Unable to write " + path);
+    return 20 + children_size;
+}
@@ -0,0 +1,109 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_VOX_HH
+#define VOXELSLICER_VOX_HH
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "thread_pool.hh"
+
+// MagicaVoxel models can't be larger than this along any axis
+#define VOX_MODEL_SIZE 256
+// Palette index 0 is reserved for empty voxels
+#define VOX_PALETTE_SIZE 255
+
+/* Reduces voxel colors to a small palette. Colors are counted in bins of
+ * their top 5 bits of red, green and blue, which also keep the exact sum of
+ * the colors in them. Each thread can count into its own quantizer, and the
+ * quantizers are merged afterwards. If the colors fit in the palette as they
+ * are, they are used exactly; otherwise the bins are split into palette
+ * colors with median cut.
+ */
+class color_quantizer
+{
+public:
+    color_quantizer();
+
+    void add(const uint8_t* rgba)
+    {
+        uint32_t color;
+        memcpy(&color, rgba, sizeof(color));
+        bin& b = bins[get_key(rgba)];
+        if(b.count == 0) b.first = color;
+        else if(b.first != color) b.mixed = true;
+        b.count++;
+        for(unsigned i = 0; i < 4; ++i) b.sum[i] += rgba[i];
+    }
+
+    void merge(const color_quantizer& other);
+
+    // Builds a palette of at most max_colors colors from the counted ones.
+    void build(unsigned max_colors, thread_pool& pool);
+
+    // Palette colors as RGBA bytes
+    const std::vector<uint32_t>& get_palette() const { return palette; }
+
+    // Palette index of a counted color, after build()
+    uint8_t map(const uint8_t* rgba) const { return lut[get_key(rgba)]; }
+
+private:
+    struct bin
+    {
+        uint32_t count = 0;
+        // The first color counted, and whether any other color was
+        uint32_t first = 0;
+        bool mixed = false;
+        uint64_t sum[4] = {0, 0, 0, 0};
+    };
+
+    static unsigned get_key(const uint8_t* rgba)
+    {
+        return (rgba[0] >> 3) << 10 | (rgba[1] >> 3) << 5 | rgba[2] >> 3;
+    }
+
+    std::vector<bin> bins;
+    std::vector<uint32_t> palette;
+    std::vector<uint8_t> lut;
+};
+
+/* One model of a .vox file, covering a part of the volume. Positions are in
+ * the z-up coordinates of the file.
+ */
+struct vox_model
+{
+    glm::uvec3 offset;
+    glm::uvec3 size;
+    // x, y, z and color index bytes of each voxel, relative to offset
+    std::vector<uint8_t> voxels;
+};
+
+/* Writes a MagicaVoxel file of the given models, which are placed by their
+ * offsets in a scene graph. Colors index into palette starting from 1, as
+ * .vox files do. Returns the size of the file.
+ */
+size_t write_vox(
+    const std::string& path,
+    const std::vector<vox_model>& models,
+    const std::vector<uint32_t>& palette
+);
+
+#endif
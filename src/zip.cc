@@ -0,0 +1,186 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "zip.hh"
+#include <ctime>
+#include <stdexcept>
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END 0x06054b50
+#define ZIP64_END 0x06064b50
+#define ZIP64_LOCATOR 0x07064b50
+#define ZIP64_EXTRA 0x0001
+#define ZIP_VERSION 20
+#define ZIP64_VERSION 45
+// File names are UTF-8
+#define ZIP_FLAGS 0x0800
+#define ZIP_STORED 0
+#define ZIP_MAX16 0xFFFFu
+#define ZIP_MAX32 0xFFFFFFFFu
+
+static void put_u16(std::vector<uint8_t>& out, uint16_t value)
+{
+    for(unsigned i = 0; i < 2; ++i) out.push_back(value >> (i*8));
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for(unsigned i = 0; i < 4; ++i) out.push_back(value >> (i*8));
+}
+
+static void put_u64(std::vector<uint8_t>& out, uint64_t value)
+{
+    for(unsigned i = 0; i < 8; ++i) out.push_back(value >> (i*8));
+}
+
+// Field value, or the marker for it being in the zip64 extra field
+static uint32_t clamp32(uint64_t value)
+{
+    return value >= ZIP_MAX32 ? ZIP_MAX32 : value;
+}
+
+zip_writer::zip_writer(const std::string& path)
+:   path(path), file(path, std::ios::binary), offset(0)
+{
+    if(!file) throw std::runtime_error("Unable to write " + path);
+
+    // All files get the time the archive was created
+    time_t now = time(nullptr);
+    struct tm t;
+    localtime_r(&now, &t);
+    dos_time = t.tm_hour << 11 | t.tm_min << 5 | t.tm_sec / 2;
+    dos_date = (t.tm_year < 80 ? 0 : t.tm_year - 80) << 9 |
+        (t.tm_mon + 1) << 5 | t.tm_mday;
+}
+
+void zip_writer::add(
+    const std::string& name,
+    const std::vector<uint8_t>& data,
+    uint32_t crc
+){
+    entry e = {name, crc, data.size(), offset};
+    bool large = e.size >= ZIP_MAX32;
+
+    std::vector<uint8_t> head;
+    put_u32(head, ZIP_LOCAL_HEADER);
+    put_u16(head, large ? ZIP64_VERSION : ZIP_VERSION);
+    put_u16(head, ZIP_FLAGS);
+    put_u16(head, ZIP_STORED);
+    put_u16(head, dos_time);
+    put_u16(head, dos_date);
+    put_u32(head, crc);
+    put_u32(head, clamp32(e.size));
+    put_u32(head, clamp32(e.size));
+    put_u16(head, name.size());
+    put_u16(head, large ? 20 : 0);
+    head.insert(head.end(), name.begin(), name.end());
+    if(large)
+    {
+        put_u16(head, ZIP64_EXTRA);
+        put_u16(head, 16);
+        put_u64(head, e.size);
+        put_u64(head, e.size);
+    }
+
+    file.write(reinterpret_cast<const char*>(head.data()), head.size());
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if(!file) throw std::runtime_error("Unable to write " + path);
+    offset += head.size() + data.size();
+    entries.push_back(e);
+}
+
+void zip_writer::finish()
+{
+    std::vector<uint8_t> dir;
+    for(const entry& e: entries)
+    {
+        bool large_size = e.size >= ZIP_MAX32;
+        bool large_offset = e.offset >= ZIP_MAX32;
+        unsigned extra_size = (large_size ? 16 : 0) + (large_offset ? 8 : 0);
+        uint16_t version = extra_size ? ZIP64_VERSION : ZIP_VERSION;
+
+        put_u32(dir, ZIP_CENTRAL_HEADER);
+        put_u16(dir, version);
+        put_u16(dir, version);
+        put_u16(dir, ZIP_FLAGS);
+        put_u16(dir, ZIP_STORED);
+        put_u16(dir, dos_time);
+        put_u16(dir, dos_date);
+        put_u32(dir, e.crc);
+        put_u32(dir, clamp32(e.size));
+        put_u32(dir, clamp32(e.size));
+        put_u16(dir, e.name.size());
+        put_u16(dir, extra_size ? extra_size + 4 : 0);
+        // No comment, disk 0, no attributes
+        put_u16(dir, 0);
+        put_u16(dir, 0);
+        put_u16(dir, 0);
+        put_u32(dir, 0);
+        put_u32(dir, clamp32(e.offset));
+        dir.insert(dir.end(), e.name.begin(), e.name.end());
+        if(extra_size)
+        {
+            put_u16(dir, ZIP64_EXTRA);
+            put_u16(dir, extra_size);
+            if(large_size)
+            {
+                put_u64(dir, e.size);
+                put_u64(dir, e.size);
+            }
+            if(large_offset) put_u64(dir, e.offset);
+        }
+    }
+
+    uint64_t dir_offset = offset;
+    uint64_t dir_size = dir.size();
+    uint64_t count = entries.size();
+    if(count >= ZIP_MAX16 || dir_offset >= ZIP_MAX32 || dir_size >= ZIP_MAX32)
+    {
+        uint64_t end64_offset = dir_offset + dir_size;
+        put_u32(dir, ZIP64_END);
+        put_u64(dir, 44);
+        put_u16(dir, ZIP64_VERSION);
+        put_u16(dir, ZIP64_VERSION);
+        put_u32(dir, 0);
+        put_u32(dir, 0);
+        put_u64(dir, count);
+        put_u64(dir, count);
+        put_u64(dir, dir_size);
+        put_u64(dir, dir_offset);
+
+        put_u32(dir, ZIP64_LOCATOR);
+        put_u32(dir, 0);
+        put_u64(dir, end64_offset);
+        put_u32(dir, 1);
+    }
+
+    put_u32(dir, ZIP_END);
+    put_u16(dir, 0);
+    put_u16(dir, 0);
+    put_u16(dir, count >= ZIP_MAX16 ? ZIP_MAX16 : count);
+    put_u16(dir, count >= ZIP_MAX16 ? ZIP_MAX16 : count);
+    put_u32(dir, clamp32(dir_size));
+    put_u32(dir, clamp32(dir_offset));
+    put_u16(dir, 0);
+
+    file.write(reinterpret_cast<const char*>(dir.data()), dir.size());
+    file.close();
+    if(!file) throw std::runtime_error("Unable to write " + path);
+    offset += dir.size();
+}
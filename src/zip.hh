@@ -0,0 +1,65 @@
+/*
+    Copyright 2018 Julius Ikkala
+
+    This file is part of VoxelSlicer.
+
+    VoxelSlicer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    VoxelSlicer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VoxelSlicer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXELSLICER_ZIP_HH
+#define VOXELSLICER_ZIP_HH
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+
+/* Writes an uncompressed zip archive file by file, in one sequential pass.
+ * The central directory at the end indexes the files, so readers can find
+ * any of them without scanning the archive. Zip64 records are used where
+ * the archive outgrows the 32-bit fields.
+ */
+class zip_writer
+{
+public:
+    explicit zip_writer(const std::string& path);
+    zip_writer(const zip_writer& other) = delete;
+
+    // Appends a file of the given data, whose CRC-32 is crc.
+    void add(
+        const std::string& name,
+        const std::vector<uint8_t>& data,
+        uint32_t crc
+    );
+
+    // Writes the central directory once all files are added.
+    void finish();
+
+private:
+    struct entry
+    {
+        std::string name;
+        uint32_t crc;
+        uint64_t size;
+        uint64_t offset;
+    };
+
+    std::string path;
+    std::ofstream file;
+    uint64_t offset;
+    uint16_t dos_time;
+    uint16_t dos_date;
+    std::vector<entry> entries;
+};
+
+#endif